@@ -0,0 +1,631 @@
+//
+//  aot.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/19/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "aot.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "expr.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+#if ENABLE_AOT
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Bumped whenever the layout below or the module's exports change
+static const int aot_abi = 1;
+
+/* Runtime every module starts with. Values are `msd_value`
+ by value; `clo` is only meaningful for MSD_CLOSURE. A
+ closure's `func` indexes `msd_funcs`, and closures of the
+ same `shape` are equal, as FuncVals with the same formal
+ argument and an equal body are. */
+static const char *c_prelude =
+"#include <setjmp.h>\n"
+"#include <stdlib.h>\n"
+"\n"
+"enum { MSD_NUM, MSD_BOOL, MSD_CLOSURE };\n"
+"typedef struct msd_closure msd_closure;\n"
+"typedef struct { int kind; int rep; msd_closure *clo; } msd_value;\n"
+"struct msd_closure {\n"
+"    msd_value (*fn)(msd_closure *self, msd_value arg);\n"
+"    int func;\n"
+"    int shape;\n"
+"    msd_value captured[];\n"
+"};\n"
+"typedef struct { const char *source; int ncaptured; const char *const *captured; } msd_func_info;\n"
+"\n"
+"static jmp_buf msd_error_jmp;\n"
+"static const char *msd_error;\n"
+"\n"
+"static _Noreturn void msd_fail(const char *message) {\n"
+"    msd_error = message;\n"
+"    longjmp(msd_error_jmp, 1);\n"
+"}\n"
+"\n"
+"typedef struct msd_chunk { struct msd_chunk *next; size_t used, size; } msd_chunk;\n"
+"static msd_chunk *msd_chunks;\n"
+"\n"
+"static void *msd_alloc(size_t n) {\n"
+"    n = (n + 7) & ~(size_t)7;\n"
+"    if (msd_chunks == NULL || msd_chunks->used + n > msd_chunks->size) {\n"
+"        size_t size = n > (1 << 20) ? n : (1 << 20);\n"
+"        msd_chunk *chunk = malloc(sizeof(msd_chunk) + size);\n"
+"        if (chunk == NULL)\n"
+"            msd_fail(\"out of memory\");\n"
+"        chunk->next = msd_chunks;\n"
+"        chunk->used = 0;\n"
+"        chunk->size = size;\n"
+"        msd_chunks = chunk;\n"
+"    }\n"
+"    void *p = (char *)(msd_chunks + 1) + msd_chunks->used;\n"
+"    msd_chunks->used += n;\n"
+"    return p;\n"
+"}\n"
+"\n"
+"void msd_release(void) {\n"
+"    while (msd_chunks != NULL) {\n"
+"        msd_chunk *next = msd_chunks->next;\n"
+"        free(msd_chunks);\n"
+"        msd_chunks = next;\n"
+"    }\n"
+"}\n"
+"\n"
+"static inline msd_value msd_num(int rep) { msd_value v = { MSD_NUM, rep, NULL }; return v; }\n"
+"static inline msd_value msd_bool(int rep) { msd_value v = { MSD_BOOL, rep, NULL }; return v; }\n"
+"\n"
+"static inline msd_value msd_closure_new(msd_value (*fn)(msd_closure *, msd_value), int func, int shape, int ncaptured) {\n"
+"    msd_closure *clo = msd_alloc(sizeof(msd_closure) + ncaptured * sizeof(msd_value));\n"
+"    clo->fn = fn;\n"
+"    clo->func = func;\n"
+"    clo->shape = shape;\n"
+"    msd_value v = { MSD_CLOSURE, 0, clo };\n"
+"    return v;\n"
+"}\n"
+"\n"
+"static inline msd_value msd_closure_value(msd_closure *clo) { msd_value v = { MSD_CLOSURE, 0, clo }; return v; }\n"
+"\n"
+"static inline msd_value msd_add(msd_value a, msd_value b) {\n"
+"    if (a.kind == MSD_NUM && b.kind == MSD_NUM)\n"
+"        return msd_num((int)((unsigned)a.rep + (unsigned)b.rep));\n"
+"    msd_fail(a.kind == MSD_NUM ? \"Addend is not a number\" : a.kind == MSD_BOOL ? \"No adding booleans\" : \"No adding functions\");\n"
+"}\n"
+"\n"
+"static inline msd_value msd_mult(msd_value a, msd_value b) {\n"
+"    if (a.kind == MSD_NUM && b.kind == MSD_NUM)\n"
+"        return msd_num((int)((unsigned)a.rep * (unsigned)b.rep));\n"
+"    msd_fail(a.kind == MSD_NUM ? \"Mult is not a number\" : a.kind == MSD_BOOL ? \"No multiplying booleans\" : \"No multiplying functions\");\n"
+"}\n"
+"\n"
+"static inline msd_value msd_equ(msd_value a, msd_value b) {\n"
+"    if (a.kind != MSD_CLOSURE)\n"
+"        return msd_bool(a.kind == b.kind && a.rep == b.rep);\n"
+"    return msd_bool(b.kind == MSD_CLOSURE && a.clo->shape == b.clo->shape);\n"
+"}\n"
+"\n"
+"static inline int msd_test(msd_value v) {\n"
+"    if (v.kind != MSD_BOOL)\n"
+"        msd_fail(\"if part doesn't evaluate to a bool val!\");\n"
+"    return v.rep;\n"
+"}\n"
+"\n"
+"static inline msd_value msd_call(msd_value f, msd_value arg) {\n"
+"    if (f.kind != MSD_CLOSURE)\n"
+"        msd_fail(f.kind == MSD_NUM ? \"not call a num\" : \"not call a bool\");\n"
+"    return f.clo->fn(f.clo, arg);\n"
+"}\n"
+"\n";
+
+// A C string literal of `s`
+static std::string c_string(const std::string &s){
+    std::string out = "\"";
+    for(char c : s){
+        if(c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+/* Source of an expression that `parse` reads back as the
+ same tree. Unlike `to_string` it puts every operation in
+ parentheses. */
+static void print_source(Expr *e, std::ostream &out){
+    switch(e->kind){
+        case Expr::num_expr:
+            out << static_cast<NumExpr*>(e)->val;
+            break;
+        case Expr::bool_expr:
+            out << (static_cast<BoolExpr*>(e)->val ? "_true" : "_false");
+            break;
+        case Expr::var_expr:
+            out << static_cast<VarExpr*>(e)->name.to_string();
+            break;
+        case Expr::add_expr:
+        case Expr::mult_expr:
+        case Expr::equ_expr: {
+            Expr *lhs, *rhs;
+            const char *op;
+            if(e->kind == Expr::add_expr){
+                lhs = RAW(static_cast<AddExpr*>(e)->lhs);
+                rhs = RAW(static_cast<AddExpr*>(e)->rhs);
+                op = " + ";
+            }else if(e->kind == Expr::mult_expr){
+                lhs = RAW(static_cast<MultExpr*>(e)->lhs);
+                rhs = RAW(static_cast<MultExpr*>(e)->rhs);
+                op = " * ";
+            }else{
+                lhs = RAW(static_cast<EquExpr*>(e)->lhs);
+                rhs = RAW(static_cast<EquExpr*>(e)->rhs);
+                op = " == ";
+            }
+            out << "(";
+            print_source(lhs, out);
+            out << op;
+            print_source(rhs, out);
+            out << ")";
+            break;
+        }
+        case Expr::call_expr: {
+            CallExpr *call = static_cast<CallExpr*>(e);
+            out << "(";
+            print_source(RAW(call->to_be_called), out);
+            out << ")(";
+            print_source(RAW(call->actual_arg), out);
+            out << ")";
+            break;
+        }
+        case Expr::let_expr: {
+            LetExpr *let = static_cast<LetExpr*>(e);
+            out << "(_let " << let->let_var.to_string() << " = ";
+            print_source(RAW(let->rhs), out);
+            out << " _in ";
+            print_source(RAW(let->body), out);
+            out << ")";
+            break;
+        }
+        case Expr::if_expr: {
+            IfExpr *ife = static_cast<IfExpr*>(e);
+            out << "(_if ";
+            print_source(RAW(ife->test_part), out);
+            out << " _then ";
+            print_source(RAW(ife->then_part), out);
+            out << " _else ";
+            print_source(RAW(ife->else_part), out);
+            out << ")";
+            break;
+        }
+        case Expr::letrec_expr: {
+            LetRecExpr *let = static_cast<LetRecExpr*>(e);
+            FuncExpr *fun = static_cast<FuncExpr*>(RAW(let->rhs));
+            out << "(_letrec " << let->let_var.to_string() << " = (_fun (" << fun->formal_arg.to_string() << ") ";
+            print_source(RAW(fun->body), out);
+            out << ") _in ";
+            print_source(RAW(let->body), out);
+            out << ")";
+            break;
+        }
+        case Expr::func_expr: {
+            FuncExpr *fun = static_cast<FuncExpr*>(e);
+            if(fun->self_applied){
+                print_source(RAW(fun->source()), out);
+                break;
+            }
+            // a named function is read back as the `_letrec` that made it
+            if(fun->self != Symbol())
+                out << "(_letrec " << fun->self.to_string() << " = ";
+            out << "(_fun (" << fun->formal_arg.to_string() << ") ";
+            print_source(RAW(fun->body), out);
+            out << ")";
+            if(fun->self != Symbol())
+                out << " _in " << fun->self.to_string() << ")";
+            break;
+        }
+    }
+}
+
+/* Lowers one program to C. Code for an expression is
+ appended to a function's statements, and `lower` returns
+ a C expression for its value, which is either a constant,
+ a variable or a temporary, so reading it has no effect
+ and the statements keep MSDScript's evaluation order. */
+class CWriter {
+public:
+    std::ostringstream decls;
+    std::ostringstream defs;
+    std::ostringstream infos;
+    int nfuncs;
+    int nlocals;
+    // Representative of each closure shape
+    std::vector<FuncExpr*> shapes;
+    // Variables visible in the code being lowered, innermost last, and the C that reads them
+    std::vector<Symbol> names;
+    std::vector<std::string> places;
+    
+    CWriter() : nfuncs(0), nlocals(0) {}
+    
+    std::string local(const char *prefix){
+        return prefix + std::to_string(nlocals++);
+    }
+    
+    bool resolve(Symbol name, std::string &place){
+        for(size_t i = names.size(); i-- > 0; )
+            if(names[i] == name){
+                place = places[i];
+                return true;
+            }
+        return false;
+    }
+    
+    int shape_of(FuncExpr *fun){
+        for(size_t i = 0; i < shapes.size(); i++)
+            if(shapes[i]->formal_arg == fun->formal_arg && shapes[i]->body->equals(fun->body)
+               && shapes[i]->self == fun->self && shapes[i]->self_applied == fun->self_applied)
+                return (int)i;
+        shapes.push_back(fun);
+        return (int)shapes.size() - 1;
+    }
+    
+    std::string binary(const char *op, Expr *lhs, Expr *rhs, std::string &out, const std::string &indent){
+        std::string a = lower(lhs, out, indent);
+        std::string b = lower(rhs, out, indent);
+        std::string t = local("t");
+        out += indent + "msd_value " + t + " = " + op + "(" + a + ", " + b + ");\n";
+        return t;
+    }
+    
+    /* A closure of `fun` made here: its C function, the
+     values it captures (the free variables of `fun` that
+     are bound here, as `FuncExpr::capture` keeps them) and
+     its entry in `msd_funcs`. */
+    std::string closure(FuncExpr *fun, std::string &out, const std::string &indent){
+        int index = nfuncs++;
+        std::vector<Symbol> captured;
+        std::vector<std::string> captured_places;
+        std::string place;
+        for(Symbol name : fun->free_vars())
+            if(resolve(name, place)){
+                captured.push_back(name);
+                captured_places.push_back(place);
+            }
+    
+        std::string t = local("t");
+        out += indent + "msd_value " + t + " = msd_closure_new(fn_" + std::to_string(index) + ", " + std::to_string(index)
+            + ", " + std::to_string(shape_of(fun)) + ", " + std::to_string(captured.size()) + ");\n";
+        for(size_t i = 0; i < captured.size(); i++)
+            out += indent + t + ".clo->captured[" + std::to_string(i) + "] = " + captured_places[i] + ";\n";
+    
+        // The body sees only what it captured and its argument
+        std::vector<Symbol> outer_names;
+        std::vector<std::string> outer_places;
+        names.swap(outer_names);
+        places.swap(outer_places);
+        for(size_t i = 0; i < captured.size(); i++){
+            names.push_back(captured[i]);
+            places.push_back("self->captured[" + std::to_string(i) + "]");
+        }
+        if(fun->self != Symbol()){
+            // a named function is the closure it runs in
+            names.push_back(fun->self);
+            places.push_back("msd_closure_value(self)");
+        }
+        names.push_back(fun->formal_arg);
+        places.push_back("arg");
+        std::string body;
+        std::string result = lower(RAW(fun->body), body, "    ");
+        names.swap(outer_names);
+        places.swap(outer_places);
+    
+        std::string header = "static msd_value fn_" + std::to_string(index) + "(msd_closure *self, msd_value arg)";
+        decls << header << ";\n";
+        defs << header << " {\n" << body << "    return " << result << ";\n}\n\n";
+    
+        std::ostringstream source;
+        print_source(fun, source);
+        std::string names_array = "NULL";
+        if(!captured.empty()){
+            names_array = "msd_captured_" + std::to_string(index);
+            defs << "static const char *const " << names_array << "[] = {";
+            for(size_t i = 0; i < captured.size(); i++)
+                defs << (i ? ", " : "") << c_string(captured[i].to_string());
+            defs << "};\n\n";
+        }
+        infos << "    [" << index << "] = {" << c_string(source.str()) << ", " << captured.size() << ", " << names_array << "},\n";
+        return t;
+    }
+    
+    std::string lower(Expr *e, std::string &out, const std::string &indent){
+        switch(e->kind){
+            case Expr::num_expr:
+                return "msd_num(" + std::to_string(static_cast<NumExpr*>(e)->val) + ")";
+            case Expr::bool_expr:
+                return static_cast<BoolExpr*>(e)->val ? "msd_bool(1)" : "msd_bool(0)";
+            case Expr::var_expr: {
+                Symbol name = static_cast<VarExpr*>(e)->name;
+                std::string place;
+                if(resolve(name, place))
+                    return place;
+                out += indent + "msd_fail(" + c_string("free variable" + name.to_string()) + ");\n";
+                return "msd_num(0)";
+            }
+            case Expr::add_expr:
+                return binary("msd_add", RAW(static_cast<AddExpr*>(e)->lhs), RAW(static_cast<AddExpr*>(e)->rhs), out, indent);
+            case Expr::mult_expr:
+                return binary("msd_mult", RAW(static_cast<MultExpr*>(e)->lhs), RAW(static_cast<MultExpr*>(e)->rhs), out, indent);
+            case Expr::equ_expr:
+                return binary("msd_equ", RAW(static_cast<EquExpr*>(e)->lhs), RAW(static_cast<EquExpr*>(e)->rhs), out, indent);
+            case Expr::call_expr:
+                return binary("msd_call", RAW(static_cast<CallExpr*>(e)->to_be_called), RAW(static_cast<CallExpr*>(e)->actual_arg), out, indent);
+            case Expr::let_expr: {
+                LetExpr *let = static_cast<LetExpr*>(e);
+                std::string rhs = lower(RAW(let->rhs), out, indent);
+                std::string v = local("v");
+                out += indent + "msd_value " + v + " = " + rhs + ";\n";
+                names.push_back(let->let_var);
+                places.push_back(v);
+                std::string result = lower(RAW(let->body), out, indent);
+                names.pop_back();
+                places.pop_back();
+                return result;
+            }
+            case Expr::letrec_expr: {
+                // the function names itself, so the binding is a `_let`'s
+                LetRecExpr *let = static_cast<LetRecExpr*>(e);
+                std::string fun = lower(RAW(let->rhs), out, indent);
+                names.push_back(let->let_var);
+                places.push_back(fun);
+                std::string result = lower(RAW(let->body), out, indent);
+                names.pop_back();
+                places.pop_back();
+                return result;
+            }
+            case Expr::if_expr: {
+                IfExpr *ife = static_cast<IfExpr*>(e);
+                std::string test = lower(RAW(ife->test_part), out, indent);
+                std::string t = local("t");
+                out += indent + "msd_value " + t + ";\n";
+                out += indent + "if (msd_test(" + test + ")) {\n";
+                std::string then_val = lower(RAW(ife->then_part), out, indent + "    ");
+                out += indent + "    " + t + " = " + then_val + ";\n";
+                out += indent + "} else {\n";
+                std::string else_val = lower(RAW(ife->else_part), out, indent + "    ");
+                out += indent + "    " + t + " = " + else_val + ";\n";
+                out += indent + "}\n";
+                return t;
+            }
+            case Expr::func_expr:
+                return closure(static_cast<FuncExpr*>(e), out, indent);
+        }
+        throw std::runtime_error((std::string)"cannot compile expression");
+    }
+};
+
+std::string Aot::to_c(PTR(Expr) e){
+    CWriter writer;
+    std::string body;
+    std::string result = writer.lower(RAW(e), body, "    ");
+
+    std::ostringstream c;
+    c << "/* Generated by msdscript --compile */\n\n" << c_prelude;
+    c << writer.decls.str() << "\n" << writer.defs.str();
+    c << "static msd_value msd_main(void) {\n" << body << "    return " << result << ";\n}\n\n";
+    c << "const int msd_abi = " << aot_abi << ";\n";
+    c << "const int msd_nfuncs = " << writer.nfuncs << ";\n";
+    // One spare entry, as C has no empty arrays
+    c << "const msd_func_info msd_funcs[] = {\n" << writer.infos.str() << "    [" << writer.nfuncs << "] = {NULL, 0, NULL}\n};\n\n";
+    c << "int msd_run(msd_value *result, const char **error) {\n"
+         "    if (setjmp(msd_error_jmp)) {\n"
+         "        *error = msd_error;\n"
+         "        return 1;\n"
+         "    }\n"
+         "    *result = msd_main();\n"
+         "    return 0;\n"
+         "}\n";
+    return c.str();
+}
+
+// `s` quoted for the shell
+static std::string shell_quote(const std::string &s){
+    std::string out = "'";
+    for(char c : s){
+        if(c == '\'')
+            out += "'\\''";
+        else
+            out += c;
+    }
+    return out + "'";
+}
+
+void Aot::compile(PTR(Expr) e, const std::string &so_path){
+#if ENABLE_AOT
+    std::string c_path = so_path + ".c";
+    std::ofstream file(c_path);
+    file << to_c(e);
+    file.close();
+    if(!file)
+        throw std::runtime_error((std::string)"cannot write " + c_path);
+    const char *cc = std::getenv("CC");
+    std::string command = (cc != nullptr && *cc != '\0' ? cc : "cc");
+    command += " -O2 -shared -fPIC -o " + shell_quote(so_path) + " " + shell_quote(c_path);
+    int status = std::system(command.c_str());
+    std::remove(c_path.c_str());
+    if(status != 0)
+        throw std::runtime_error((std::string)"C compiler failed: " + command);
+#else
+    throw std::runtime_error((std::string)"native compilation is not available");
+#endif
+}
+
+#if ENABLE_AOT
+/* The module's view of a value and a closure, laid out as
+ `msd_value` and `msd_closure` in `c_prelude`; a closure's
+ captured values follow it. */
+struct AotClosure;
+struct AotValue {
+    int kind;  // 0 number, 1 boolean, 2 closure
+    int rep;
+    AotClosure *clo;
+};
+struct AotClosure {
+    void *fn;
+    int func;
+    int shape;
+};
+struct AotFuncInfo {
+    const char *source;
+    int ncaptured;
+    const char *const *captured;
+};
+
+typedef int (*aot_run_fn)(AotValue *result, const char **error);
+
+// Native recursion replaces the step machine's heap, so the run gets a deep stack
+static const size_t aot_stack_size = sizeof(void*) == 8 ? (size_t)1 << 30 : (size_t)64 << 20;
+
+struct AotRun {
+    aot_run_fn run;
+    AotValue result;
+    const char *error;
+    int status;
+};
+
+static void *run_module(void *p){
+    AotRun *r = static_cast<AotRun*>(p);
+    r->status = r->run(&r->result, &r->error);
+    return nullptr;
+}
+
+/* A Value of a module's result. A closure becomes a FuncVal
+ of its function, parsed back from its source once per
+ module, and a FlatEnv of what it captured. */
+static Value from_module(const AotValue &v, const AotFuncInfo *funcs, std::vector<PTR(FuncExpr)> &parsed){
+    if(v.kind == 0)
+        return Value::num(v.rep);
+    if(v.kind == 1)
+        return Value::boolean(v.rep != 0);
+    const AotFuncInfo &info = funcs[v.clo->func];
+    PTR(FuncExpr) &fun = parsed[v.clo->func];
+    if(fun == nullptr){
+        PTR(Expr) source = parse_str(info.source);
+        // a named function comes back as `_letrec f = _fun ... _in f`
+        if(source->kind == Expr::letrec_expr)
+            source = CAST(LetRecExpr)(source)->rhs;
+        fun = CAST(FuncExpr)(source);
+    }
+    PTR(Env) env = Env::emptyenv;
+    if(info.ncaptured > 0){
+        const AotValue *captured = reinterpret_cast<const AotValue*>(v.clo + 1);
+        PTR(FlatEnv) flat = NEW(FlatEnv)();
+        for(int i = 0; i < info.ncaptured; i++)
+            flat->bind(Symbol(info.captured[i]), from_module(captured[i], funcs, parsed));
+        env = flat;
+    }
+    return Value::object(NEW(FuncVal)(fun, env));
+}
+#endif
+
+Value Aot::run(const std::string &so_path){
+#if ENABLE_AOT
+    // dlopen searches the library path for a bare name
+    std::string path = so_path.find('/') == std::string::npos ? "./" + so_path : so_path;
+    void *module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(module == nullptr)
+        throw std::runtime_error((std::string)"cannot load " + so_path + ": " + dlerror());
+    const int *abi = static_cast<const int*>(dlsym(module, "msd_abi"));
+    const int *nfuncs = static_cast<const int*>(dlsym(module, "msd_nfuncs"));
+    const AotFuncInfo *funcs = static_cast<const AotFuncInfo*>(dlsym(module, "msd_funcs"));
+    AotRun r = {reinterpret_cast<aot_run_fn>(dlsym(module, "msd_run")), AotValue(), nullptr, 0};
+    void (*release)() = reinterpret_cast<void (*)()>(dlsym(module, "msd_release"));
+    if(abi == nullptr || *abi != aot_abi || nfuncs == nullptr || funcs == nullptr || r.run == nullptr || release == nullptr){
+        dlclose(module);
+        throw std::runtime_error((std::string)"not an msdscript module: " + so_path);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, aot_stack_size);
+    pthread_t thread;
+    if(pthread_create(&thread, &attr, run_module, &r) == 0)
+        pthread_join(thread, nullptr);
+    else
+        run_module(&r);
+    pthread_attr_destroy(&attr);
+
+    // Made directly where the caller allocates: the run itself made no Values
+    Value result;
+    std::string error;
+    if(r.status != 0){
+        error = r.error;
+    }else{
+        std::vector<PTR(FuncExpr)> parsed(*nfuncs);
+        result = from_module(r.result, funcs, parsed);
+    }
+    release();
+    dlclose(module);
+    if(r.status != 0)
+        throw std::runtime_error(error);
+    return result;
+#else
+    throw std::runtime_error((std::string)"native compilation is not available");
+#endif
+}
+
+#if ENABLE_AOT
+TEST_CASE( "aot" ){
+    if(std::system("cc --version > /dev/null 2>&1") != 0)
+        return;
+    std::string so_path = "/tmp/msdscript_aot_" + std::to_string(getpid()) + ".so";
+    auto native = [&](const std::string &source){
+        Aot::compile(parse_str(source), so_path);
+        return Aot::run(so_path);
+    };
+
+    // Same results as the step interpreter
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 2 + -1 _then 1"
+                      "                   _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                      "_in fib(fib)(10)";
+    CHECK( native(fib).equals(Value::num(89)) );
+    CHECK( native("_let x = 5 _in _let f = _fun (y) x * y _in _let x = 2 _in f(x) == 10").equals(Value::boolean(true)) );
+    CHECK( native("(_fun (x) x) == (_fun (x) x)").equals(Value::boolean(true)) );
+    CHECK( native("_let f = _fun (x) x _in f == _fun (y) y").equals(Value::boolean(false)) );
+    // Recursion much deeper than the default C stack
+    CHECK( native("_let count = _fun (f) _fun (n) _if n == 0 _then 0 _else 1 + f(f)(n + -1) _in count(count)(1000000)")
+          .equals(Value::num(1000000)) );
+
+    // A closure comes back as a FuncVal, with what it captured
+    Value add3 = native("_let k = 3 _in _fun (x) x + k");
+    Value add3_step = Step::interp_by_steps(parse_str("_let k = 3 _in _fun (x) x + k"));
+    CHECK( add3.equals(add3_step) );
+    CHECK( add3.to_string() == add3_step.to_string() );
+    CHECK( add3.call(Value::num(4)).equals(Value::num(7)) );
+    // and a `_letrec`'s with its name
+    std::string down = "_let k = 0 _in _letrec down = _fun (n) _if n == k _then _true _else down(n + -1) _in down";
+    Value native_down = native(down);
+    CHECK( native_down.equals(Step::interp_by_steps(parse_str(down))) );
+    CHECK( native_down.call(Value::num(3)).equals(Value::boolean(true)) );
+    CHECK( native("_letrec fib = _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(x + -1) + fib(x + -2)"
+                  " _in fib(10)").equals(Value::num(89)) );
+
+    // Same errors
+    CHECK_THROWS_WITH( native("_true + 1"), "No adding booleans" );
+    CHECK_THROWS_WITH( native("1 + _true"), "Addend is not a number" );
+    CHECK_THROWS_WITH( native("(_fun (x) x) * 2"), "No multiplying functions" );
+    CHECK_THROWS_WITH( native("_if 1 _then 2 _else 3"), "if part doesn't evaluate to a bool val!" );
+    CHECK_THROWS_WITH( native("_let f = _fun (x) y _in f(1)"), "free variabley" );
+    CHECK_THROWS_WITH( native("_false(1)"), "not call a bool" );
+    CHECK_THROWS( Aot::run("/tmp/msdscript_aot_no_such_module.so") );
+    std::remove(so_path.c_str());
+}
+#endif
@@ -0,0 +1,60 @@
+//
+//  aot.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/19/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef aot_hpp
+#define aot_hpp
+
+#include <string>
+#include "pointer.hpp"
+#include "value.hpp"
+
+// 1: `--compile` and `--run` are available (needs a C compiler, dlopen and pthreads), 0: they throw
+#ifndef ENABLE_AOT
+#if defined(__unix__) || defined(__APPLE__)
+#define ENABLE_AOT 1
+#else
+#define ENABLE_AOT 0
+#endif
+#endif
+
+class Expr;
+
+/* Ahead-of-time compiler from a whole program to C, and
+ loader of the native modules the system C compiler makes
+ of it.
+
+ Each `_fun` becomes a C function of its closure and its
+ argument, and every variable is resolved at compile time
+ to a C local or a slot of the closure, so running the
+ module does no lookups and no reference counting. Numbers
+ and booleans are unboxed; closures live in a bump arena
+ that is freed when the run ends. A module keeps the
+ source of each of its functions, so a closure it returns
+ becomes an ordinary FuncVal.
+
+ Results and errors are those of `Step::interp_by_steps`.
+ Function calls are C calls, run on a thread with a large
+ stack instead of the step machine's heap. A module is not
+ reentrant: one run at a time. */
+class Aot {
+public:
+    // The C translation unit for `e`
+    static std::string to_c(PTR(Expr) e);
+    
+    /* Lower `e` to C and build it with `$CC` (default `cc`)
+     into the shared object `so_path`. Throws if the C
+     compiler fails. */
+    static void compile(PTR(Expr) e, const std::string &so_path);
+    
+    /* Load a module made by `compile`, run it and return its
+     value. Throws what `Step::interp_by_steps` would throw
+     for the program. */
+    static Value run(const std::string &so_path);
+};
+
+#endif /* aot_hpp */
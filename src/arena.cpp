@@ -0,0 +1,146 @@
+//
+//  arena.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/15/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "arena.hpp"
+#include <cstdint>
+#include "pointer.hpp"
+#include "value.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "vm.hpp"
+#include "step.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+static const size_t first_chunk_size = 64 * 1024;
+static const size_t max_chunk_size = 1024 * 1024;
+
+thread_local Arena *Arena::current = nullptr;
+
+Arena::Arena(){
+    next = nullptr;
+    limit = nullptr;
+    used = 0;
+    enclosing = current;
+    current = this;
+}
+
+Arena::~Arena(){
+    for(size_t i = finalizers.size(); i-- > 0; )
+        finalizers[i].destroy(finalizers[i].obj);
+    for(size_t i = 0; i < chunks.size(); i++)
+        ::operator delete(chunks[i].start);
+    current = enclosing;
+}
+
+void *Arena::allocate(size_t size, size_t align){
+    uintptr_t at = ((uintptr_t)next + align - 1) & ~(uintptr_t)(align - 1);
+    if(next == nullptr || at + size > (uintptr_t)limit){
+        // Chunks double in size up to a limit; a bigger object gets its own
+        size_t chunk_size = chunks.empty() ? first_chunk_size : chunks.back().size * 2;
+        if(chunk_size > max_chunk_size)
+            chunk_size = max_chunk_size;
+        if(chunk_size < size + align)
+            chunk_size = size + align;
+        Chunk c = {static_cast<char*>(::operator new(chunk_size)), chunk_size};
+        chunks.push_back(c);
+        next = c.start;
+        limit = c.start + chunk_size;
+        at = ((uintptr_t)next + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    next = (char*)(at + size);
+    used += size;
+    return (void*)at;
+}
+
+bool Arena::contains(const void *p){
+    for(size_t i = 0; i < chunks.size(); i++)
+        if(p >= chunks[i].start && p < chunks[i].start + chunks[i].size)
+            return true;
+    return false;
+}
+
+size_t Arena::bytes_used(){
+    return used;
+}
+
+static Value escape_value(Arena &arena, Value val);
+
+static PTR(Env) escape_env(Arena &arena, PTR(Env) env){
+    if(!arena.contains(RAW(env)))
+        return env;
+    PTR(ExtendedEnv) extended = CAST(ExtendedEnv)(env);
+    if(extended != nullptr)
+        return NEW(ExtendedEnv)(extended->name, escape_value(arena, extended->val), escape_env(arena, extended->rest));
+    PTR(FlatEnv) flat = CAST(FlatEnv)(env);
+    PTR(FlatEnv) copy = NEW(FlatEnv)();
+    for(int i = 0; i < flat->size; i++)
+        copy->bind(flat->binding(i).name, escape_value(arena, flat->binding(i).val));
+    return copy;
+}
+
+static Value escape_value(Arena &arena, Value val){
+    if(val.kind != Value::obj_kind || !arena.contains(RAW(val.obj)))
+        return val;
+    if(val.obj->kind == Val::func_val){
+        // the body belongs to the program, which is not in the arena
+        FuncVal *fv = static_cast<FuncVal*>(RAW(val.obj));
+        return Value::object(NEW(FuncVal)(fv->fun, escape_env(arena, fv->env)));
+    }
+    ClosureVal *cv = static_cast<ClosureVal*>(RAW(val.obj));
+    std::vector<Value> captured;
+    for(size_t i = 0; i < cv->captured.size(); i++)
+        captured.push_back(escape_value(arena, cv->captured[i]));
+    return Value::object(NEW(ClosureVal)(cv->code, cv->func, captured.data(), captured.size()));
+}
+
+Value Arena::escape(Value val){
+    Arena *saved = current;
+    current = enclosing;
+    Value copy = escape_value(*this, val);
+    current = saved;
+    return copy;
+}
+
+TEST_CASE( "arena" ){
+    {
+        Arena outer;
+        CHECK( Arena::current == &outer );
+        {
+            Arena inner;
+            CHECK( Arena::current == &inner );
+            int *n = static_cast<int*>(inner.allocate(sizeof(int), alignof(int)));
+            CHECK( inner.contains(n) );
+            CHECK( !outer.contains(n) );
+            void *big = inner.allocate(4 * max_chunk_size, 16);
+            CHECK( inner.contains(big) );
+            CHECK( ((uintptr_t)big & 15) == 0 );
+            CHECK( inner.bytes_used() == sizeof(int) + 4 * max_chunk_size );
+        }
+        CHECK( Arena::current == &outer );
+    }
+    CHECK( Arena::current == nullptr );
+    
+    // A function result outlives the arena of the evaluation that made it
+    Value add = Step::interp_by_steps(parse_str("_let a = 1 _in _let f = _fun (x) _fun (y) x + y + a _in f(2)"));
+    CHECK( add.call(Value::num(3)).equals(Value::num(6)) );
+    Value twice = VM::interp_by_vm(parse_str("_let a = 2 _in _fun (x) x * a"));
+    CHECK( twice.call(Value::num(5)).equals(Value::num(10)) );
+    CHECK( Expr::interp_by_tree(parse_str("_let f = _fun (x) _fun (y) x + y _in f(4)"))
+          .call(Value::num(1)).equals(Value::num(5)) );
+#if ENABLE_ARENA
+    {
+        Arena arena;
+        PTR(Val) v = NEW(FuncVal)("x", VarExpr::make("x"), Env::emptyenv);
+        CHECK( arena.contains(v) );
+        Value kept = arena.escape(Value::object(v));
+        CHECK( !arena.contains(RAW(kept.obj)) );
+        CHECK( kept.equals(Value::object(v)) );
+    }
+#endif
+}
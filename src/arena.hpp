@@ -0,0 +1,119 @@
+//
+//  arena.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/15/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef arena_hpp
+#define arena_hpp
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "pointer.hpp"
+
+class Value;
+
+/* A region of memory for one evaluation. Objects are bump
+ allocated from large chunks and all released at once when
+ the arena is destroyed; only the ones with a non-trivial
+ destructor (those holding a std::vector) are visited.
+ Arenas nest: creating one makes it `current` until it is
+ destroyed, so they must be scoped like local variables.
+ 
+ With ENABLE_ARENA in pointer.hpp, NEW allocates in the
+ current arena, or on the heap when there is none. In the
+ other modes nothing is allocated here and `escape` just
+ returns its argument.
+ 
+ Releasing an arena is O(1) in the number of objects as
+ long as none of them needs a finalizer; classes that hold
+ an `ArenaVector` declare `arena_needs_finalizer` false. */
+class Arena {
+public:
+    static thread_local Arena *current;
+    
+    Arena();
+    ~Arena();
+    void *allocate(size_t size, size_t align);
+    // Run `p`'s destructor when the arena is released
+    template <class T> void own(T *p) {
+        Finalizer f = {p, [](void *q) { static_cast<T*>(q)->~T(); }};
+        finalizers.push_back(f);
+    }
+    bool contains(const void *p);
+    size_t bytes_used();
+    
+    /* Copy a value, and whatever it refers to in this arena,
+     into the enclosing arena (or the heap), so it can be
+     returned from the evaluation that owns this arena. */
+    Value escape(Value val);
+    
+private:
+    struct Chunk {
+        char *start;
+        size_t size;
+    };
+    struct Finalizer {
+        void *obj;
+        void (*destroy)(void *);
+    };
+    std::vector<Chunk> chunks;
+    std::vector<Finalizer> finalizers;
+    char *next;
+    char *limit;
+    size_t used;
+    Arena *enclosing;
+    
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+};
+
+/* STL allocator for containers inside heap objects. With
+ ENABLE_ARENA it takes memory from the arena that is current
+ when the container is made, which is the arena its owner
+ lives in, and never gives it back; otherwise it is the
+ plain heap. */
+template <class T> class ArenaAllocator {
+public:
+    typedef T value_type;
+    Arena *arena;
+    
+    ArenaAllocator() : arena(ENABLE_ARENA ? Arena::current : nullptr) {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+    T *allocate(size_t n) {
+        if (arena == nullptr)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, size_t n) {
+        if (arena == nullptr)
+            ::operator delete(p);
+    }
+    template <class U> bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+    template <class U> bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+};
+
+template <class T> using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+// Whether a T in an arena must have its destructor run when the arena is released
+template <class T> struct arena_needs_finalizer {
+    static const bool value = !std::is_trivially_destructible<T>::value;
+};
+
+// Allocate a T in the current arena, or on the heap when there is none
+template <class T, class... Args> T *arena_new(Args&&... args) {
+    Arena *arena = Arena::current;
+    if (arena == nullptr)
+        return new T(std::forward<Args>(args)...);
+    T *p = new (arena->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (arena_needs_finalizer<T>::value)
+        arena->own(p);
+    return p;
+}
+
+#endif /* arena_hpp */
@@ -11,16 +11,21 @@
 #include "value.hpp"
 #include "env.hpp"
 #include "expr.hpp"
+#include "gc.hpp"
 
 
 PTR(Cont) Cont::done = NEW(DoneCont)();
+static GC::Root<PTR(Cont)> done_root(&Cont::done);
 
 DoneCont::DoneCont() { }
 
-void DoneCont::step_continue() {
+void DoneCont::step_continue(Step &step) {
     throw std::runtime_error("can't continue done");
 }
 
+void DoneCont::trace(GC &gc) {
+}
+
 
 RightThenAddCont::RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
     this->rhs = rhs;
@@ -28,24 +33,35 @@ RightThenAddCont::RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest)
     this->rest = rest;
 }
 
-void RightThenAddCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(AddCont)(lhs_val, rest);
+void RightThenAddCont::step_continue(Step &step) {
+    Value lhs_val = step.val;
+    step.mode = Step::interp_mode;
+    step.expr = RAW(rhs);
+    step.env = env;
+    step.cont = NEW(AddCont)(lhs_val, rest);
+}
+
+void RightThenAddCont::trace(GC &gc) {
+    gc.mark(RAW(rhs));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
 }
 
-AddCont::AddCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+AddCont::AddCont(Value lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void AddCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->add_to(rhs_val);
-    Step::cont = rest;
+void AddCont::step_continue(Step &step) {
+    Value rhs_val = step.val;
+    step.mode = Step::continue_mode;
+    step.val = lhs_val.add_to(rhs_val);
+    step.cont = rest;
+}
+
+void AddCont::trace(GC &gc) {
+    gc.mark(lhs_val);
+    gc.mark(RAW(rest));
 }
 
 RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -54,24 +70,35 @@ RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest
     this->rest = rest;
 }
 
-void RightThenMultCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(MultCont)(lhs_val, rest);
+void RightThenMultCont::step_continue(Step &step) {
+    Value lhs_val = step.val;
+    step.mode = Step::interp_mode;
+    step.expr = RAW(rhs);
+    step.env = env;
+    step.cont = NEW(MultCont)(lhs_val, rest);
+}
+
+void RightThenMultCont::trace(GC &gc) {
+    gc.mark(RAW(rhs));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
 }
 
-MultCont::MultCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+MultCont::MultCont(Value lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void MultCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->mult_with(rhs_val);
-    Step::cont = rest;
+void MultCont::step_continue(Step &step) {
+    Value rhs_val = step.val;
+    step.mode = Step::continue_mode;
+    step.val = lhs_val.mult_with(rhs_val);
+    step.cont = rest;
+}
+
+void MultCont::trace(GC &gc) {
+    gc.mark(lhs_val);
+    gc.mark(RAW(rest));
 }
 
 RightThenCompCont::RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -80,27 +107,35 @@ RightThenCompCont::RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest
     this->rest = rest;
 }
 
-void RightThenCompCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(CompCont)(lhs_val, rest);
+void RightThenCompCont::step_continue(Step &step) {
+    Value lhs_val = step.val;
+    step.mode = Step::interp_mode;
+    step.expr = RAW(rhs);
+    step.env = env;
+    step.cont = NEW(CompCont)(lhs_val, rest);
+}
+
+void RightThenCompCont::trace(GC &gc) {
+    gc.mark(RAW(rhs));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
 }
 
-CompCont::CompCont(PTR(Val) lhs_val, PTR(Cont) rest) {
+CompCont::CompCont(Value lhs_val, PTR(Cont) rest) {
     this->lhs_val = lhs_val;
     this->rest = rest;
 }
 
-void CompCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    if (lhs_val->equals(rhs_val))
-        Step::val = NEW(BoolVal)(true);
-    else
-        Step::val = NEW(BoolVal)(false);
-    Step::cont = rest;
+void CompCont::step_continue(Step &step) {
+    Value rhs_val = step.val;
+    step.mode = Step::continue_mode;
+    step.val = Value::boolean(lhs_val.equals(rhs_val));
+    step.cont = rest;
+}
+
+void CompCont::trace(GC &gc) {
+    gc.mark(lhs_val);
+    gc.mark(RAW(rest));
 }
 
 ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest) {
@@ -109,21 +144,32 @@ ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) r
     this->rest = rest;
 }
 
-void ArgThenCallCont::step_continue() {
-    PTR(Val) to_be_called = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = actual_arg;
-    Step::env = env;
-    Step::cont = NEW(CallCont)(to_be_called, rest);
+void ArgThenCallCont::step_continue(Step &step) {
+    Value to_be_called = step.val;
+    step.mode = Step::interp_mode;
+    step.expr = RAW(actual_arg);
+    step.env = env;
+    step.cont = NEW(CallCont)(to_be_called, rest);
 }
 
-CallCont::CallCont(PTR(Val) to_be_called, PTR(Cont) rest) {
+void ArgThenCallCont::trace(GC &gc) {
+    gc.mark(RAW(actual_arg));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
+}
+
+CallCont::CallCont(Value to_be_called, PTR(Cont) rest) {
     this->to_be_called = to_be_called;
     this->rest = rest;
 }
 
-void CallCont::step_continue() {
-    to_be_called->call_step(Step::val, rest);
+void CallCont::step_continue(Step &step) {
+    to_be_called.call_step(step.val, rest, step);
+}
+
+void CallCont::trace(GC &gc) {
+    gc.mark(to_be_called);
+    gc.mark(RAW(rest));
 }
 
 IfBranchCont::IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest) {
@@ -133,31 +179,60 @@ IfBranchCont::IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) en
     this->rest = rest;
 }
 
-void IfBranchCont::step_continue() {
-    PTR(BoolVal) if_val = CAST(BoolVal)(Step::val);
-    
-    if (if_val == NULL)
+void IfBranchCont::step_continue(Step &step) {
+    if (step.val.kind != Value::bool_kind)
         throw std::runtime_error("if part doesn't evaluate to a bool val!");
-    else if (if_val->rep == true)
-        Step::expr = then_part;
+    else if (step.val.rep)
+        step.expr = RAW(then_part);
     else
-        Step::expr = else_part;
-    Step::env = env;
-    Step::mode = Step::interp_mode;
-    Step::cont = rest;
+        step.expr = RAW(else_part);
+    step.env = env;
+    step.mode = Step::interp_mode;
+    step.cont = rest;
+}
+
+void IfBranchCont::trace(GC &gc) {
+    gc.mark(RAW(then_part));
+    gc.mark(RAW(else_part));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
 }
 
-LetBodyCont::LetBodyCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
+LetBodyCont::LetBodyCont(Symbol var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
     this->var = var;
     this->body = body;
     this->env = env;
     this->rest = rest;
 }
 
-void LetBodyCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::env = NEW(ExtendedEnv)(var, rhs_val, Step::env);
-    Step::expr = body;
-    Step::cont = rest;
+void LetBodyCont::step_continue(Step &step) {
+    Value rhs_val = step.val;
+    step.mode = Step::interp_mode;
+    step.env = NEW(ExtendedEnv)(var, rhs_val, env);
+    step.expr = RAW(body);
+    step.cont = rest;
+}
+
+void LetBodyCont::trace(GC &gc) {
+    gc.mark(RAW(body));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
+}
+
+MemoizeCont::MemoizeCont(PTR(Expr) fun, PTR(Env) env, PTR(Cont) rest) {
+    this->fun = fun;
+    this->env = env;
+    this->rest = rest;
+}
+
+void MemoizeCont::step_continue(Step &step) {
+    ExtendedEnv *call = static_cast<ExtendedEnv*>(RAW(env));
+    step.memo.store(Memo::Key(fun, call->rest, call->val), step.val);
+    step.cont = rest;
+}
+
+void MemoizeCont::trace(GC &gc) {
+    gc.mark(RAW(fun));
+    gc.mark(RAW(env));
+    gc.mark(RAW(rest));
 }
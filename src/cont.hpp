@@ -11,23 +11,27 @@
 
 #include <iostream>
 #include "pointer.hpp"
+#include "value.hpp"
 
 class Expr;
-class Val;
 class Env;
+class Step;
+class GC;
 
 class Cont ENABLE_THIS(Cont) {
 public:
     /* To take one step in the computation starting
      with this continuation, reading from the registers
-     in `Step` and updating them to indicate the next
-     step. The `Step::cont` register will contain
+     of the `step` machine and updating them to indicate
+     the next step. The `step.cont` register will contain
      this continuation (so it's uninteresting), and
-     the `Step::val` register will contain the value
+     the `step.val` register will contain the value
      that this continuaion was waiting form.
-     The `Step::expr` register is unspecified
+     The `step.expr` register is unspecified
      (i.e., must not be used by this method). */
-    virtual void step_continue() = 0;
+    virtual void step_continue(Step &step) = 0;
+    // Mark the objects it points to (see gc.hpp)
+    virtual void trace(GC &gc) = 0;
     
     static PTR(Cont) done;
 };
@@ -35,7 +39,8 @@ public:
 class DoneCont : public Cont {
 public:
     DoneCont();
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class RightThenAddCont : public Cont {
@@ -45,16 +50,18 @@ public:
     PTR(Cont) rest;
     
     RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class AddCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Value lhs_val;
     PTR(Cont) rest;
     
-    AddCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    AddCont(Value lhs_val, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class RightThenMultCont : public Cont {
@@ -64,16 +71,18 @@ public:
     PTR(Cont) rest;
     
     RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class MultCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Value lhs_val;
     PTR(Cont) rest;
     
-    MultCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    MultCont(Value lhs_val, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class RightThenCompCont : public Cont {
@@ -83,16 +92,18 @@ public:
     PTR(Cont) rest;
     
     RightThenCompCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class CompCont : public Cont {
 public:
-    PTR(Val) lhs_val;
+    Value lhs_val;
     PTR(Cont) rest;
     
-    CompCont(PTR(Val) lhs_val, PTR(Cont) rest);
-    void step_continue();
+    CompCont(Value lhs_val, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class ArgThenCallCont : public Cont {
@@ -102,16 +113,18 @@ public:
     PTR(Cont) rest;
     
     ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class CallCont : public Cont {
 public:
-    PTR(Val) to_be_called;
+    Value to_be_called;
     PTR(Cont) rest;
     
-    CallCont(PTR(Val) to_be_called, PTR(Cont) rest);
-    void step_continue();
+    CallCont(Value to_be_called, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class IfBranchCont : public Cont {
@@ -122,18 +135,34 @@ public:
     PTR(Cont) rest;
     
     IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 class LetBodyCont : public Cont {
 public:
-    std::string var;
+    Symbol var;
     PTR(Expr) body;
     PTR(Env) env;
     PTR(Cont) rest;
     
-    LetBodyCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
-    void step_continue();
+    LetBodyCont(Symbol var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
+};
+
+/* Records the value of a call of `fun`, a FuncExpr, in
+ the machine's `memo`. `env` is the call's own, which holds
+ the argument in front of the function's environment. */
+class MemoizeCont : public Cont {
+public:
+    PTR(Expr) fun;
+    PTR(Env) env;
+    PTR(Cont) rest;
+    
+    MemoizeCont(PTR(Expr) fun, PTR(Env) env, PTR(Cont) rest);
+    void step_continue(Step &step);
+    void trace(GC &gc);
 };
 
 #endif /* cont_hpp */
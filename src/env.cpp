@@ -7,31 +7,129 @@
 //
 
 #include "env.hpp"
+#include <stdexcept>
 #include "value.hpp"
+#include "gc.hpp"
 
 PTR(Env) Env::emptyenv = NEW(EmptyEnv)();
+static GC::Root<PTR(Env)> emptyenv_root(&Env::emptyenv);
 
-PTR(Val) EmptyEnv::lookup(std::string file_name){
-    throw std::runtime_error((std::string)"free variable" + file_name);
+Value Env::lookup(Symbol file_name){
+    Value val;
+    if(!find(file_name, val))
+        throw std::runtime_error((std::string)"free variable" + file_name.to_string());
+    return val;
+}
+
+bool EmptyEnv::find(Symbol file_name, Value &val){
+    return false;
 }
 
 bool EmptyEnv::equals(PTR(Env) env){
     return CAST(EmptyEnv)(env) != nullptr;
 }
 
-ExtendedEnv::ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest){
+void EmptyEnv::trace(GC &gc){
+}
+
+ExtendedEnv::ExtendedEnv(Symbol name, Value val, PTR(Env) rest){
     this->name = name;
     this->val = val;
     this->rest = rest;
 }
 
-PTR(Val) ExtendedEnv::lookup(std::string file_name){
-    if(file_name == name) return val;
-    else return rest->lookup(file_name);
+bool ExtendedEnv::find(Symbol file_name, Value &val){
+    if(file_name == name){
+        val = this->val;
+        return true;
+    }
+    else return rest->find(file_name, val);
 }
 
 bool ExtendedEnv::equals(PTR(Env) env){
     PTR(ExtendedEnv) e = CAST(ExtendedEnv)(env);
     if(e == nullptr) return false;
-    else return name == e->name && val->equals(e->val) && rest->equals(e->rest);
+    else return name == e->name && val.equals(e->val) && rest->equals(e->rest);
+}
+
+void ExtendedEnv::trace(GC &gc){
+    gc.mark(val);
+    gc.mark(RAW(rest));
+}
+
+CallEnv::CallEnv(Symbol name, Value val, Symbol self, Value fun, PTR(Env) rest) : ExtendedEnv(name, val, rest){
+    this->self = self;
+    this->fun = fun;
+}
+
+bool CallEnv::find(Symbol file_name, Value &val){
+    // the argument shadows the function's own name
+    if(file_name == self && file_name != name){
+        val = fun;
+        return true;
+    }
+    return ExtendedEnv::find(file_name, val);
+}
+
+bool CallEnv::equals(PTR(Env) env){
+    PTR(CallEnv) e = CAST(CallEnv)(env);
+    return e != nullptr && self == e->self && fun.equals(e->fun) && ExtendedEnv::equals(env);
+}
+
+void CallEnv::trace(GC &gc){
+    gc.mark(fun);
+    ExtendedEnv::trace(gc);
+}
+
+FlatEnv::FlatEnv(){
+    size = 0;
+}
+
+FlatEnv::FlatEnv(const std::vector<Symbol> &names, PTR(Env) env){
+    size = 0;
+    Value val;
+    for(size_t i = 0; i < names.size(); i++)
+        if(env->find(names[i], val))
+            bind(names[i], val);
+}
+
+void FlatEnv::bind(Symbol name, Value val){
+    if(size < inline_size){
+        inline_bindings[size].name = name;
+        inline_bindings[size].val = val;
+    }else{
+        Binding b = {name, val};
+        more_bindings.push_back(b);
+    }
+    size++;
+    GC::heap().write_barrier(this);
+}
+
+FlatEnv::Binding &FlatEnv::binding(int i){
+    return i < inline_size ? inline_bindings[i] : more_bindings[i - inline_size];
+}
+
+bool FlatEnv::find(Symbol file_name, Value &val){
+    for(int i = 0; i < size; i++){
+        Binding &b = binding(i);
+        if(b.name == file_name){
+            val = b.val;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FlatEnv::equals(PTR(Env) env){
+    PTR(FlatEnv) e = CAST(FlatEnv)(env);
+    if(e == nullptr || size != e->size) return false;
+    for(int i = 0; i < size; i++)
+        if(binding(i).name != e->binding(i).name || !binding(i).val.equals(e->binding(i).val))
+            return false;
+    return true;
+}
+
+void FlatEnv::trace(GC &gc){
+    for(int i = 0; i < size; i++)
+        gc.mark(binding(i).val);
 }
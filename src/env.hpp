@@ -11,31 +11,96 @@
 
 #include "pointer.hpp"
 #include <string>
+#include <vector>
+#include "value.hpp"
+#include "symbol.hpp"
+#include "arena.hpp"
 
-class Val;
+class GC;
 
 class Env ENABLE_THIS(Env){
 public:
     static PTR(Env) emptyenv;
-    virtual PTR(Val) lookup(std::string file_name) = 0;
+    // Value of a variable; throws if it is free
+    Value lookup(Symbol file_name);
+    // Value of a variable; returns false if it is free
+    virtual bool find(Symbol file_name, Value &val) = 0;
     virtual bool equals(PTR(Env) env) = 0;
+    // Mark the objects it points to (see gc.hpp)
+    virtual void trace(GC &gc) = 0;
 };
 
 class EmptyEnv : public Env{
 public:
-    PTR(Val) lookup(std::string file_name);
+    bool find(Symbol file_name, Value &val);
     bool equals(PTR(Env) env);
+    void trace(GC &gc);
 };
 
+/* One binding in front of `rest`. The tree and step
+ interpreters find a variable by walking these, one symbol
+ id compare per binding: a VarExpr is one hash-consed node
+ shared by every scope it is written in, so it cannot
+ carry a depth and slot. Only the VM resolves them (see
+ Scope). */
 class ExtendedEnv : public Env{
 public:
-    std::string name;
-    PTR(Val) val;
+    Symbol name;
+    Value val;
     PTR(Env) rest;
     
-    ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest);
-    PTR(Val) lookup(std::string file_name);
+    ExtendedEnv(Symbol name, Value val, PTR(Env) rest);
+    bool find(Symbol file_name, Value &val);
     bool equals(PTR(Env) env);
+    void trace(GC &gc);
+};
+
+/* Frame of a call of a named function (see FuncExpr): the
+ argument and the function itself under its name, in one
+ allocation. The function does not point to its frames,
+ so no cycle is made. */
+class CallEnv : public ExtendedEnv{
+public:
+    Symbol self;
+    Value fun;
+    
+    CallEnv(Symbol name, Value val, Symbol self, Value fun, PTR(Env) rest);
+    bool find(Symbol file_name, Value &val);
+    bool equals(PTR(Env) env);
+    void trace(GC &gc);
+};
+
+/* Environment of a closure: a copy of just the variables
+ its body uses, with no `rest`, so the closure does not
+ keep the rest of its creator's chain alive. The first
+ few bindings are stored inline to save an allocation.
+ Names that are free at creation are left out and fail
+ at lookup as usual. */
+class FlatEnv : public Env{
+public:
+    struct Binding {
+        Symbol name;
+        Value val;
+    };
+    static const int inline_size = 4;
+    
+    int size;
+    Binding inline_bindings[inline_size];
+    ArenaVector<Binding> more_bindings;  // past inline_size
+    
+    FlatEnv();
+    FlatEnv(const std::vector<Symbol> &names, PTR(Env) env);
+    // Add a binding after the others
+    void bind(Symbol name, Value val);
+    Binding &binding(int i);
+    bool find(Symbol file_name, Value &val);
+    bool equals(PTR(Env) env);
+    void trace(GC &gc);
+};
+
+// `more_bindings` lives in the same arena
+template <> struct arena_needs_finalizer<FlatEnv> {
+    static const bool value = false;
 };
 
 #endif /* env_hpp */
@@ -6,46 +6,441 @@
 //  Copyright © 2020 Xuefeng Xu. All rights reserved.
 //
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include "expr.hpp"
 #include "env.hpp"
 #include "step.hpp"
 #include "value.hpp"
 #include "cont.hpp"
+#include "vm.hpp"
+#include "arena.hpp"
+#include "gc.hpp"
+#include "jit.hpp"
+#include "memo.hpp"
+#include "parse.hpp"
 #include "catch.hpp"
 
+Value Expr::interp_by_tree(PTR(Expr) e){
+    Arena arena;
+    Memo memo;
+    Memo::Use use(Memo::enabled ? &memo : nullptr);
+    size_t region = GC::heap().start_region();
+    Value result = lower_recursion(e)->interp(Env::emptyenv);
+    // Values live in C++ locals while interpreting, so collect only at the end
+    GC::Root<Value> keep(&result);
+    GC::heap().safepoint(region);
+    return arena.escape(result);
+}
+
+/* The shape of a node: its kind, its number, boolean or
+ name, a function's own name and how it got it, and its
+ children, which are hash-consed already, so two nodes
+ have the same structure exactly when they have the same
+ shape. */
+struct Shape {
+    Expr::kind_t kind;
+    int atom;
+    int self;
+    bool self_applied;
+    Expr *parts[3];
+    size_t hash;
+    
+    Shape(Expr::kind_t kind, int atom, Expr *a = nullptr, Expr *b = nullptr, Expr *c = nullptr,
+          int self = -1, bool self_applied = false)
+        : kind(kind), atom(atom), self(self), self_applied(self_applied) {
+        parts[0] = a;
+        parts[1] = b;
+        parts[2] = c;
+        hash = ((size_t)kind * 31 + (size_t)(unsigned)atom) * 31 + (size_t)(unsigned)self * 2 + self_applied;
+        for(int i = 0; i < 3; i++)
+            hash = hash * 31 + (parts[i] == nullptr ? 0 : parts[i]->hash);
+    }
+    bool operator==(const Shape &other) const {
+        return kind == other.kind && atom == other.atom && self == other.self && self_applied == other.self_applied
+            && parts[0] == other.parts[0]
+            && parts[1] == other.parts[1] && parts[2] == other.parts[2];
+    }
+};
+
+struct ShapeHash {
+    size_t operator()(const Shape &shape) const { return shape.hash; }
+};
+
+/* Every node made, by shape, with the order it was made in.
+ The table keeps its nodes alive in every memory mode until
+ `Expr::release` drops them, and they are never put in an
+ arena. `lock` is held while it is used, so any thread can
+ parse, optimize or lower a program, except where counts
+ are not atomic (ENABLE_REFCOUNT) or the heap is not
+ shared safely (ENABLE_GC): there every node and value is
+ used by the `owner` thread only, the one that made the
+ first node, and making a node on any other throws. */
+class ExprTable {
+public:
+    struct Entry {
+        PTR(Expr) node;
+        size_t seq;  // made after every node it points to
+    };
+    typedef std::unordered_map<Shape, Entry, ShapeHash> Nodes;
+    
+    Nodes nodes;
+    std::mutex lock;
+    size_t next_seq;
+    size_t next_id;
+    std::vector<size_t> free_ids;  // of released nodes
+#if ENABLE_REFCOUNT || ENABLE_GC
+    std::thread::id owner;
+#endif
+    
+    ExprTable() : next_seq(0), next_id(1) {
+        GC::heap().add_roots(this, [](void *p, GC &gc) {
+            for(auto &entry : static_cast<ExprTable*>(p)->nodes)
+                gc.mark(RAW(entry.second.node));
+        });
+    }
+    
+    size_t new_id() {
+        if(free_ids.empty())
+            return next_id++;
+        size_t id = free_ids.back();
+        free_ids.pop_back();
+        return id;
+    }
+};
+
+static ExprTable &expr_table(){
+    static ExprTable table;
+    return table;
+}
+
+// The node of `shape`, made from `args` if there is none yet
+template <class T, class... Args> static PTR(Expr) intern(const Shape &shape, Args&&... args){
+    ExprTable &table = expr_table();
+    std::lock_guard<std::mutex> lock(table.lock);
+#if ENABLE_REFCOUNT || ENABLE_GC
+    if(table.owner == std::thread::id())
+        table.owner = std::this_thread::get_id();
+    else if(table.owner != std::this_thread::get_id())
+        throw std::runtime_error("expressions are used by one thread with ENABLE_REFCOUNT or ENABLE_GC");
+#endif
+    ExprTable::Entry &entry = table.nodes[shape];
+    PTR(Expr) &node = entry.node;
+    if(node == nullptr){
+        Arena *arena = Arena::current;
+        Arena::current = nullptr;
+        node = NEW(T)(std::forward<Args>(args)...);
+        Arena::current = arena;
+        entry.seq = table.next_seq++;
+        node->hash = shape.hash;
+        node->id = table.new_id();
+        node->size = 1;
+        for(int i = 0; i < 3; i++)
+            node->size += shape.parts[i] == nullptr ? 0 : shape.parts[i]->size;
+    }
+    return node;
+}
+
+size_t Expr::interned(){
+    ExprTable &table = expr_table();
+    std::lock_guard<std::mutex> lock(table.lock);
+    return table.nodes.size();
+}
+
+size_t Expr::release(){
+    ExprTable &table = expr_table();
+    std::lock_guard<std::mutex> lock(table.lock);
+    // Newest first: dropping a node may leave its children, which are older, unused too
+    std::vector<std::pair<size_t, ExprTable::Nodes::iterator> > order;
+    for(ExprTable::Nodes::iterator it = table.nodes.begin(); it != table.nodes.end(); ++it)
+        order.push_back(std::make_pair(it->second.seq, it));
+    std::sort(order.begin(), order.end(),
+              [](const std::pair<size_t, ExprTable::Nodes::iterator> &a,
+                 const std::pair<size_t, ExprTable::Nodes::iterator> &b) { return a.first > b.first; });
+    size_t released = 0;
+    for(auto &o : order){
+        if(UNIQUE(o.second->second.node)){
+            table.free_ids.push_back(o.second->second.node->id);
+            table.nodes.erase(o.second);
+            released++;
+        }
+    }
+    return released;
+}
+
+bool Expr::uses(Symbol var){
+    return std::binary_search(free_vars_cache.begin(), free_vars_cache.end(), var);
+}
+
+// The variables in `a` or `b`, both in symbol order
+static std::vector<Symbol> union_vars(const std::vector<Symbol> &a, const std::vector<Symbol> &b){
+    std::vector<Symbol> vars;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(vars));
+    return vars;
+}
+
+// The variables in `vars` other than `var`
+static std::vector<Symbol> without_var(const std::vector<Symbol> &vars, Symbol var){
+    std::vector<Symbol> rest;
+    for(Symbol v : vars)
+        if(v != var)
+            rest.push_back(v);
+    return rest;
+}
+
+size_t StaticEnv::inline_size = 40;
+size_t StaticEnv::inline_budget = 1000;
+
+StaticEnv::StaticEnv() : budget(inline_budget), clock(0) {
+}
+
+PTR(Expr) StaticEnv::lookup(Symbol var){
+    if(var.id < 0 || (size_t)var.id >= vals.size() || vals[var.id].val == nullptr)
+        return nullptr;
+    // a function is only put in where it is called
+    return vals[var.id].val->kind == Expr::func_expr ? nullptr : vals[var.id].val;
+}
+
+PTR(FuncExpr) StaticEnv::function(Symbol var){
+    if(var.id < 0 || (size_t)var.id >= vals.size() || vals[var.id].val == nullptr)
+        return nullptr;
+    Binding &binding = vals[var.id];
+    if(binding.val->kind != Expr::func_expr)
+        return nullptr;
+    // its free variables must not have been bound again since
+    for(Symbol free : binding.val->free_vars())
+        if((size_t)free.id < vals.size() && vals[free.id].time > binding.time)
+            return nullptr;
+    return CAST(FuncExpr)(binding.val);
+}
+
+StaticEnv::Binding StaticEnv::bind(Symbol var, PTR(Expr) val){
+    if((size_t)var.id >= vals.size())
+        vals.resize(var.id + 1, Binding{nullptr, 0});
+    Binding shadowed = vals[var.id];
+    vals[var.id].val = val;
+    vals[var.id].time = ++clock;
+    return shadowed;
+}
+
+void StaticEnv::unbind(Symbol var, Binding shadowed){
+    vals[var.id] = shadowed;
+}
+
+bool StaticEnv::can_inline(PTR(FuncExpr) fun){
+    // a named function's body needs its frame to call itself by
+    return fun->self == Symbol() && fun->body->size <= inline_size && fun->body->size <= budget
+        && std::find(inlining.begin(), inlining.end(), RAW(fun)) == inlining.end();
+}
+
+StaticEnv::Inlining::Inlining(StaticEnv &known, PTR(FuncExpr) fun) : known(known) {
+    known.budget -= fun->body->size;
+    known.inlining.push_back(RAW(fun));
+}
+
+StaticEnv::Inlining::~Inlining(){
+    known.inlining.pop_back();
+}
+
+PTR(Expr) Expr::optimize(){
+    StaticEnv known;
+    return partial_eval(known);
+}
+
+/* Whether optimizing can use the value of `e`, already
+ partially evaluated: a number or a boolean is read off
+ without running any code. A function is not one, since
+ optimizing its body changes what it compares equal to. */
+static bool is_constant(PTR(Expr) e){
+    return e->kind == Expr::num_expr || e->kind == Expr::bool_expr;
+}
+
+/* `body` in the scope of `var` bound to `rhs`, which is
+ partially evaluated already. A constant is put in where
+ the body uses it, and the binding goes; a function is
+ kept for inlining its calls, and goes once none are left. */
+static PTR(Expr) partial_eval_let(StaticEnv &known, Symbol var, PTR(Expr) rhs, PTR(Expr) body){
+    bool constant = is_constant(rhs);
+    StaticEnv::Binding shadowed = known.bind(var, constant || rhs->kind == Expr::func_expr ? rhs : nullptr);
+    PTR(Expr) body_opti = body->partial_eval(known);
+    known.unbind(var, shadowed);
+    if(constant || (rhs->kind == Expr::func_expr && !body_opti->uses(var)))
+        return body_opti;
+    return LetExpr::make(var, rhs, body_opti);
+}
+
+/* Whether each free `f` in `e` is both sides of a call
+ `f(f)`, so that `f` is only ever applied to itself, and
+ no function in `e` uses `f`: such a function would print
+ and compare differently once its `f(f)` is made `f` */
+static bool only_self_applied(PTR(Expr) e, Symbol f){
+    if(!e->uses(f))
+        return true;
+    switch(e->kind){
+        case Expr::var_expr:
+            return false;
+        case Expr::call_expr: {
+            PTR(CallExpr) call = CAST(CallExpr)(e);
+            PTR(Expr) var = VarExpr::make(f);
+            if(call->to_be_called->equals(var) && call->actual_arg->equals(var))
+                return true;
+            return only_self_applied(call->to_be_called, f) && only_self_applied(call->actual_arg, f);
+        }
+        case Expr::let_expr: {
+            PTR(LetExpr) let = CAST(LetExpr)(e);
+            return only_self_applied(let->rhs, f) && (let->let_var == f || only_self_applied(let->body, f));
+        }
+        case Expr::letrec_expr:
+            // `f` is free, so not the `_letrec`'s; its function must not use it
+            return !CAST(LetRecExpr)(e)->rhs->uses(f) && only_self_applied(CAST(LetRecExpr)(e)->body, f);
+        case Expr::func_expr:
+            return false;
+        case Expr::if_expr: {
+            PTR(IfExpr) i = CAST(IfExpr)(e);
+            return only_self_applied(i->test_part, f) && only_self_applied(i->then_part, f)
+                && only_self_applied(i->else_part, f);
+        }
+        case Expr::add_expr:
+            return only_self_applied(CAST(AddExpr)(e)->lhs, f) && only_self_applied(CAST(AddExpr)(e)->rhs, f);
+        case Expr::mult_expr:
+            return only_self_applied(CAST(MultExpr)(e)->lhs, f) && only_self_applied(CAST(MultExpr)(e)->rhs, f);
+        case Expr::equ_expr:
+            return only_self_applied(CAST(EquExpr)(e)->lhs, f) && only_self_applied(CAST(EquExpr)(e)->rhs, f);
+        default:
+            return true;
+    }
+}
+
+/* `e` with each free `f(f)` made `f` when lowering, or each
+ free `f` made `f(f)` when not, which undoes it */
+static PTR(Expr) rewrite_self(PTR(Expr) e, Symbol f, bool lowering){
+    if(!e->uses(f))
+        return e;
+    switch(e->kind){
+        case Expr::var_expr:
+            return lowering ? e : CallExpr::make(e, e);
+        case Expr::call_expr: {
+            PTR(CallExpr) call = CAST(CallExpr)(e);
+            PTR(Expr) var = VarExpr::make(f);
+            if(lowering && call->to_be_called->equals(var) && call->actual_arg->equals(var))
+                return var;
+            return CallExpr::make(rewrite_self(call->to_be_called, f, lowering), rewrite_self(call->actual_arg, f, lowering));
+        }
+        case Expr::let_expr: {
+            PTR(LetExpr) let = CAST(LetExpr)(e);
+            return LetExpr::make(let->let_var, rewrite_self(let->rhs, f, lowering),
+                                 let->let_var == f ? let->body : rewrite_self(let->body, f, lowering));
+        }
+        case Expr::letrec_expr: {
+            PTR(LetRecExpr) let = CAST(LetRecExpr)(e);
+            return LetRecExpr::make(let->let_var, rewrite_self(let->rhs, f, lowering), rewrite_self(let->body, f, lowering));
+        }
+        case Expr::func_expr: {
+            PTR(FuncExpr) fun = CAST(FuncExpr)(e);
+            return FuncExpr::make(fun->formal_arg, rewrite_self(fun->body, f, lowering), fun->self, fun->self_applied);
+        }
+        case Expr::if_expr: {
+            PTR(IfExpr) i = CAST(IfExpr)(e);
+            return IfExpr::make(rewrite_self(i->test_part, f, lowering), rewrite_self(i->then_part, f, lowering),
+                                rewrite_self(i->else_part, f, lowering));
+        }
+        case Expr::add_expr:
+            return AddExpr::make(rewrite_self(CAST(AddExpr)(e)->lhs, f, lowering), rewrite_self(CAST(AddExpr)(e)->rhs, f, lowering));
+        case Expr::mult_expr:
+            return MultExpr::make(rewrite_self(CAST(MultExpr)(e)->lhs, f, lowering), rewrite_self(CAST(MultExpr)(e)->rhs, f, lowering));
+        case Expr::equ_expr:
+            return EquExpr::make(rewrite_self(CAST(EquExpr)(e)->lhs, f, lowering), rewrite_self(CAST(EquExpr)(e)->rhs, f, lowering));
+        default:
+            return e;
+    }
+}
+
+/* Lowering is sound because `f(f)` always makes the same
+ function: `_fun (x) body` with `f` bound to what `f` is.
+ In the named function the body's `f` is that function
+ itself, which is what `f(f)` made. */
+PTR(Expr) Expr::lower_recursion(PTR(Expr) e){
+    switch(e->kind){
+        case Expr::call_expr: {
+            PTR(CallExpr) call = CAST(CallExpr)(e);
+            return CallExpr::make(lower_recursion(call->to_be_called), lower_recursion(call->actual_arg));
+        }
+        case Expr::let_expr: {
+            PTR(LetExpr) let = CAST(LetExpr)(e);
+            PTR(Expr) rhs = lower_recursion(let->rhs);
+            PTR(Expr) body = lower_recursion(let->body);
+            // `_fun (f) _fun (x) inner`, both unnamed, with `x` not `f`
+            PTR(FuncExpr) outer = rhs->kind == Expr::func_expr ? CAST(FuncExpr)(rhs) : nullptr;
+            PTR(FuncExpr) fun = outer != nullptr && outer->self == Symbol() && outer->body->kind == Expr::func_expr
+                ? CAST(FuncExpr)(outer->body) : nullptr;
+            if(fun == nullptr || fun->self != Symbol() || fun->formal_arg == outer->formal_arg)
+                return LetExpr::make(let->let_var, rhs, body);
+            Symbol f = outer->formal_arg;
+            if(!fun->body->uses(f) || !only_self_applied(fun->body, f) || !only_self_applied(body, let->let_var))
+                return LetExpr::make(let->let_var, rhs, body);
+            return LetExpr::make(let->let_var, FuncExpr::make(fun->formal_arg, rewrite_self(fun->body, f, true), f, true),
+                                 rewrite_self(body, let->let_var, true));
+        }
+        case Expr::letrec_expr: {
+            PTR(LetRecExpr) let = CAST(LetRecExpr)(e);
+            return LetRecExpr::make(let->let_var, lower_recursion(let->rhs), lower_recursion(let->body));
+        }
+        case Expr::func_expr: {
+            PTR(FuncExpr) fun = CAST(FuncExpr)(e);
+            return FuncExpr::make(fun->formal_arg, lower_recursion(fun->body), fun->self, fun->self_applied);
+        }
+        case Expr::if_expr: {
+            PTR(IfExpr) i = CAST(IfExpr)(e);
+            return IfExpr::make(lower_recursion(i->test_part), lower_recursion(i->then_part), lower_recursion(i->else_part));
+        }
+        case Expr::add_expr:
+            return AddExpr::make(lower_recursion(CAST(AddExpr)(e)->lhs), lower_recursion(CAST(AddExpr)(e)->rhs));
+        case Expr::mult_expr:
+            return MultExpr::make(lower_recursion(CAST(MultExpr)(e)->lhs), lower_recursion(CAST(MultExpr)(e)->rhs));
+        case Expr::equ_expr:
+            return EquExpr::make(lower_recursion(CAST(EquExpr)(e)->lhs), lower_recursion(CAST(EquExpr)(e)->rhs));
+        default:
+            return e;
+    }
+}
+
 NumExpr::NumExpr(int val) {
+    this->kind = Expr::num_expr;
     this->val = val;
 }
 
-bool NumExpr::equals(PTR(Expr) e) {
-    PTR(NumExpr) n = CAST(NumExpr)(e);
-    if (n == NULL)
-        return false;
-    else
-        return val == n->val;
+PTR(Expr) NumExpr::make(int val){
+    return intern<NumExpr>(Shape(Expr::num_expr, val), val);
 }
 
-PTR(Val) NumExpr::interp(PTR(Env) env){
-    return NEW(NumVal)(val);
+Value NumExpr::interp(PTR(Env) env){
+    return Value::num(val);
 }
 
-void NumExpr::step_interp(){
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(NumVal)(val);
-    Step::cont = Step::cont;
+void NumExpr::step_interp(Step &step){
+    step.mode = Step::continue_mode;
+    step.val = Value::num(val);
 }
 
-PTR(Expr) NumExpr::subst(std::string var, PTR(Val) new_val){
-    return THIS;
+void NumExpr::compile(PTR(Code) code){
+    code->emit(OP_CONST, code->add_const(Value::num(val)));
+}
+
+void NumExpr::trace(GC &gc){
 }
 
-PTR(Expr) NumExpr::optimize(){
+PTR(Expr) NumExpr::subst(Symbol var, Value new_val){
     return THIS;
 }
 
-bool NumExpr::containsVar(){
-    return false;
+PTR(Expr) NumExpr::partial_eval(StaticEnv &known){
+    return THIS;
 }
 
 std::string NumExpr::to_string(){
@@ -53,39 +448,51 @@ std::string NumExpr::to_string(){
 }
 
 EquExpr::EquExpr(PTR(Expr) lhs, PTR(Expr) rhs){
+    this->kind = Expr::equ_expr;
     this->lhs = lhs;
     this->rhs = rhs;
+    this->free_vars_cache = union_vars(lhs->free_vars(), rhs->free_vars());
 }
 
-bool EquExpr::equals(PTR(Expr) e){
-    PTR(EquExpr) ee = CAST(EquExpr)(e);
-    return lhs->equals(ee->lhs) && rhs->equals(ee->rhs);
+PTR(Expr) EquExpr::make(PTR(Expr) lhs, PTR(Expr) rhs){
+    return intern<EquExpr>(Shape(Expr::equ_expr, 0, RAW(lhs), RAW(rhs)), lhs, rhs);
 }
 
-PTR(Val) EquExpr::interp(PTR(Env) env){
-    return lhs->interp(env)->equals(rhs->interp(env)) ? NEW(BoolVal)(true) : NEW(BoolVal)(false);
+Value EquExpr::interp(PTR(Env) env){
+    Value lhs_val = lhs->interp(env);
+    Value rhs_val = rhs->interp(env);
+    return Value::boolean(lhs_val.equals(rhs_val));
 }
 
-void EquExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenCompCont)(rhs, Step::env, Step::cont);
+void EquExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(lhs);
+    step.push_frame(Frame::right_then_comp, RAW(rhs));
 }
 
-PTR(Expr) EquExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(EquExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
+void EquExpr::compile(PTR(Code) code){
+    lhs->compile(code);
+    rhs->compile(code);
+    code->emit(OP_EQU, 0);
 }
 
-PTR(Expr) EquExpr::optimize(){
-    PTR(Expr) lhs_opti = lhs->optimize();
-    PTR(Expr) rhs_opti = rhs->optimize();
-    if(lhs_opti->containsVar() || rhs_opti->containsVar())
-        return NEW(EquExpr)(lhs_opti, rhs_opti);
-    else return NEW(BoolExpr)(lhs_opti->equals(rhs_opti));
+void EquExpr::trace(GC &gc){
+    gc.mark(RAW(lhs));
+    gc.mark(RAW(rhs));
 }
 
-bool EquExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+PTR(Expr) EquExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    return EquExpr::make(lhs->subst(var, new_val), rhs->subst(var, new_val));
+}
+
+PTR(Expr) EquExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) lhs_opti = lhs->partial_eval(known);
+    PTR(Expr) rhs_opti = rhs->partial_eval(known);
+    if(!is_constant(lhs_opti) || !is_constant(rhs_opti))
+        return EquExpr::make(lhs_opti, rhs_opti);
+    else return BoolExpr::make(lhs_opti->equals(rhs_opti));
 }
 
 std::string EquExpr::to_string(){
@@ -93,46 +500,57 @@ std::string EquExpr::to_string(){
 }
 
 AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+    this->kind = Expr::add_expr;
     this->lhs = lhs;
     this->rhs = rhs;
+    this->free_vars_cache = union_vars(lhs->free_vars(), rhs->free_vars());
 }
 
-bool AddExpr::equals(PTR(Expr) e) {
-    PTR(AddExpr) a = CAST(AddExpr)(e);
-    if (a == NULL)
-        return false;
-    else
-        return (lhs->equals(a->lhs)
-                && rhs->equals(a->rhs));
+PTR(Expr) AddExpr::make(PTR(Expr) lhs, PTR(Expr) rhs){
+    return intern<AddExpr>(Shape(Expr::add_expr, 0, RAW(lhs), RAW(rhs)), lhs, rhs);
 }
 
-PTR(Val) AddExpr::interp(PTR(Env) env){
-    return lhs->interp(env)->add_to(rhs->interp(env));
+Value AddExpr::interp(PTR(Env) env){
+    Value lhs_val = lhs->interp(env);
+    Value rhs_val = rhs->interp(env);
+    return lhs_val.add_to(rhs_val);
 }
 
-void AddExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenAddCont)(rhs, Step::env, Step::cont);
+void AddExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(lhs);
+    step.push_frame(Frame::right_then_add, RAW(rhs));
 }
 
-
-PTR(Expr) AddExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(AddExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
+void AddExpr::compile(PTR(Code) code){
+    lhs->compile(code);
+    rhs->compile(code);
+    code->emit(OP_ADD, 0);
 }
 
-PTR(Expr) AddExpr::optimize(){
-    lhs = lhs->optimize();
-    rhs = rhs->optimize();
-    if(!lhs->containsVar() && !rhs->containsVar()){
-        PTR(Val) new_val = lhs->interp(Env::emptyenv)->add_to(rhs->interp(Env::emptyenv));
-        return new_val->to_expr();
-    }
-    return NEW(AddExpr)(lhs, rhs);
+void AddExpr::trace(GC &gc){
+    gc.mark(RAW(lhs));
+    gc.mark(RAW(rhs));
 }
 
-bool AddExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+
+PTR(Expr) AddExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    return AddExpr::make(lhs->subst(var, new_val), rhs->subst(var, new_val));
+}
+
+PTR(Expr) AddExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) lhs_opti = lhs->partial_eval(known);
+    PTR(Expr) rhs_opti = rhs->partial_eval(known);
+    if(is_constant(lhs_opti) && is_constant(rhs_opti)){
+        // a boolean operand fails at run time, so it is left to fail there
+        try {
+            return lhs_opti->interp(Env::emptyenv).add_to(rhs_opti->interp(Env::emptyenv)).to_expr();
+        } catch (std::runtime_error &) {
+        }
+    }
+    return AddExpr::make(lhs_opti, rhs_opti);
 }
 
 std::string AddExpr::to_string(){
@@ -140,125 +558,134 @@ std::string AddExpr::to_string(){
 }
 
 MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
+    this->kind = Expr::mult_expr;
     this->lhs = lhs;
     this->rhs = rhs;
+    this->free_vars_cache = union_vars(lhs->free_vars(), rhs->free_vars());
 }
 
-bool MultExpr::equals(PTR(Expr) e) {
-    PTR(MultExpr) m = CAST(MultExpr)(e);
-    if (m == NULL)
-        return false;
-    else
-        return (lhs->equals(m->lhs)
-                && rhs->equals(m->rhs));
+PTR(Expr) MultExpr::make(PTR(Expr) lhs, PTR(Expr) rhs){
+    return intern<MultExpr>(Shape(Expr::mult_expr, 0, RAW(lhs), RAW(rhs)), lhs, rhs);
 }
 
-PTR(Val) MultExpr::interp(PTR(Env) env){
-    return lhs->interp(env)->mult_with(rhs->interp(env));
+Value MultExpr::interp(PTR(Env) env){
+    return lhs->interp(env).mult_with(rhs->interp(env));
 }
 
-void MultExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::cont = NEW(RightThenMultCont)(rhs, Step::env, Step::cont);
+void MultExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(lhs);
+    step.push_frame(Frame::right_then_mult, RAW(rhs));
 }
 
-
-PTR(Expr) MultExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(MultExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
+void MultExpr::compile(PTR(Code) code){
+    lhs->compile(code);
+    rhs->compile(code);
+    code->emit(OP_MULT, 0);
 }
 
-PTR(Expr) MultExpr::optimize(){
-    lhs = lhs->optimize();
-    rhs = rhs->optimize();
-    if(!lhs->containsVar() && !rhs->containsVar()){
-        PTR(Val) new_val = lhs->interp(Env::emptyenv)->mult_with(rhs->interp(Env::emptyenv));
-        return new_val->to_expr();
-    }
-    return NEW(MultExpr)(lhs, rhs);
+void MultExpr::trace(GC &gc){
+    gc.mark(RAW(lhs));
+    gc.mark(RAW(rhs));
 }
 
-bool MultExpr::containsVar(){
-    return lhs->containsVar() || rhs->containsVar();
+
+PTR(Expr) MultExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    return MultExpr::make(lhs->subst(var, new_val), rhs->subst(var, new_val));
+}
+
+PTR(Expr) MultExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) lhs_opti = lhs->partial_eval(known);
+    PTR(Expr) rhs_opti = rhs->partial_eval(known);
+    if(is_constant(lhs_opti) && is_constant(rhs_opti)){
+        // a boolean operand fails at run time, so it is left to fail there
+        try {
+            return lhs_opti->interp(Env::emptyenv).mult_with(rhs_opti->interp(Env::emptyenv)).to_expr();
+        } catch (std::runtime_error &) {
+        }
+    }
+    return MultExpr::make(lhs_opti, rhs_opti);
 }
 
 std::string MultExpr::to_string(){
     return lhs->to_string() + " * " + rhs->to_string();
 }
 
-VarExpr::VarExpr(std::string name){
+VarExpr::VarExpr(Symbol name){
+    this->kind = Expr::var_expr;
     this->name = name;
+    this->free_vars_cache.push_back(name);
 }
 
-bool VarExpr::equals(PTR(Expr) e){
-    PTR(VarExpr) n = CAST(VarExpr)(e);
-    if (n == nullptr)
-        return false;
-    else
-        return name == n->name;
+PTR(Expr) VarExpr::make(Symbol name){
+    return intern<VarExpr>(Shape(Expr::var_expr, name.id), name);
 }
 
-PTR(Val) VarExpr::interp(PTR(Env) env){
+Value VarExpr::interp(PTR(Env) env){
     return env->lookup(name);
 }
 
-void VarExpr::step_interp(){
-    Step::mode = Step::continue_mode;
-    Step::val = Step::env->lookup(name);
-    Step::cont = Step::cont;
+void VarExpr::step_interp(Step &step){
+    step.mode = Step::continue_mode;
+    step.val = step.env->lookup(name);
+}
+
+void VarExpr::compile(PTR(Code) code){
+    code->emit_load(name);
 }
 
-PTR(Expr) VarExpr::subst(std::string var, PTR(Val) new_val){
+void VarExpr::trace(GC &gc){
+}
+
+PTR(Expr) VarExpr::subst(Symbol var, Value new_val){
     if(name == var)
-        return new_val->to_expr();
+        return new_val.to_expr();
     else
         return THIS;
 }
 
-PTR(Expr) VarExpr::optimize(){
-    return THIS;
-}
-
-bool VarExpr::containsVar(){
-    return true;
+PTR(Expr) VarExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) val = known.lookup(name);
+    return val == nullptr ? THIS : val;
 }
 
 std::string VarExpr::to_string(){
-    return name;
+    return name.to_string();
 }
 
 BoolExpr::BoolExpr(bool val){
+    this->kind = Expr::bool_expr;
     this->val = val;
 }
 
-bool BoolExpr::equals(PTR(Expr) e){
-    PTR(BoolExpr) be = CAST(BoolExpr)(e);
-    if(be == nullptr)
-        return false;
-    else
-        return val == be->val;
+PTR(Expr) BoolExpr::make(bool val){
+    return intern<BoolExpr>(Shape(Expr::bool_expr, val), val);
 }
 
-PTR(Val) BoolExpr::interp(PTR(Env) env){
-    return NEW(BoolVal)(val);
+Value BoolExpr::interp(PTR(Env) env){
+    return Value::boolean(val);
 }
 
-void BoolExpr::step_interp(){
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(BoolVal)(val);
-    Step::cont = Step::cont;
+void BoolExpr::step_interp(Step &step){
+    step.mode = Step::continue_mode;
+    step.val = Value::boolean(val);
 }
 
-PTR(Expr) BoolExpr::subst(std::string var, PTR(Val) new_val){
-    return THIS;
+void BoolExpr::compile(PTR(Code) code){
+    code->emit(OP_CONST, code->add_const(Value::boolean(val)));
 }
 
-PTR(Expr) BoolExpr::optimize(){
+void BoolExpr::trace(GC &gc){
+}
+
+PTR(Expr) BoolExpr::subst(Symbol var, Value new_val){
     return THIS;
 }
 
-bool BoolExpr::containsVar(){
-    return false;
+PTR(Expr) BoolExpr::partial_eval(StaticEnv &known){
+    return THIS;
 }
 
 std::string BoolExpr::to_string(){
@@ -267,213 +694,623 @@ std::string BoolExpr::to_string(){
 
 
 CallExpr::CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg){
+    this->kind = Expr::call_expr;
     this->to_be_called = to_be_called;
     this->actual_arg = actual_arg;
+    this->free_vars_cache = union_vars(to_be_called->free_vars(), actual_arg->free_vars());
+}
+
+PTR(Expr) CallExpr::make(PTR(Expr) to_be_called, PTR(Expr) actual_arg){
+    return intern<CallExpr>(Shape(Expr::call_expr, 0, RAW(to_be_called), RAW(actual_arg)), to_be_called, actual_arg);
 }
 
-bool CallExpr::equals(PTR(Expr) e){
-    PTR(CallExpr) ce = CAST(CallExpr)(e);
-    return to_be_called->equals(ce->to_be_called) && actual_arg->equals(ce->actual_arg);
+Value CallExpr::interp(PTR(Env) env){
+    Value fun = to_be_called->interp(env);
+    Value arg = actual_arg->interp(env);
+    Memo *memo = Memo::current;
+    if(memo == nullptr || fun.kind != Value::obj_kind || fun.obj->kind != Val::func_val)
+        return fun.call(arg);
+    FuncVal *fv = static_cast<FuncVal*>(RAW(fun.obj));
+    Memo::Key key(fv->fun, fv->env, arg);
+    Value result;
+    if(memo->find(key, result))
+        return result;
+    result = fun.call(arg);
+    memo->store(key, result);
+    return result;
 }
 
-PTR(Val) CallExpr::interp(PTR(Env) env){
-    return to_be_called->interp(env)->call(actual_arg->interp(env));
+void CallExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(to_be_called);
+    step.push_frame(Frame::arg_then_call, RAW(actual_arg));
 }
 
-void CallExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = to_be_called;
-    Step::cont = NEW(ArgThenCallCont)(actual_arg, Step::env, Step::cont);
+void CallExpr::compile(PTR(Code) code){
+    to_be_called->compile(code);
+    actual_arg->compile(code);
+    code->emit(OP_CALL, 0);
 }
 
-PTR(Expr) CallExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(CallExpr)(to_be_called->subst(var, new_val), actual_arg);
+void CallExpr::trace(GC &gc){
+    gc.mark(RAW(to_be_called));
+    gc.mark(RAW(actual_arg));
 }
 
-PTR(Expr) CallExpr::optimize(){
-    return NEW(CallExpr)(to_be_called->optimize(), actual_arg->optimize());
+PTR(Expr) CallExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    return CallExpr::make(to_be_called->subst(var, new_val), actual_arg->subst(var, new_val));
 }
 
-bool CallExpr::containsVar(){
-    return actual_arg->containsVar();
+PTR(Expr) CallExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) fun_opti = to_be_called->partial_eval(known);
+    PTR(Expr) arg_opti = actual_arg->partial_eval(known);
+    PTR(FuncExpr) fun = nullptr;
+    if(fun_opti->kind == Expr::func_expr)
+        fun = CAST(FuncExpr)(fun_opti);
+    else if(fun_opti->kind == Expr::var_expr)
+        fun = known.function(CAST(VarExpr)(fun_opti)->name);
+    if(fun == nullptr || !known.can_inline(fun))
+        return CallExpr::make(fun_opti, arg_opti);
+    // beta-reduce: `_let formal_arg = actual_arg _in body`
+    StaticEnv::Inlining inlining(known, fun);
+    return partial_eval_let(known, fun->formal_arg, arg_opti, fun->body);
 }
 
 std::string CallExpr::to_string(){
     return to_be_called->to_string() + "(" + actual_arg->to_string() + ")";
 }
 
-LetExpr::LetExpr(std::string let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr){
+LetExpr::LetExpr(Symbol let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr){
+    this->kind = Expr::let_expr;
     this->let_var = let_var;
     this->rhs = eq_expr;
     this->body = in_expr;
+    this->free_vars_cache = union_vars(eq_expr->free_vars(), without_var(in_expr->free_vars(), let_var));
 }
 
-bool LetExpr::equals(PTR(Expr) e){
-    PTR(LetExpr) le = CAST(LetExpr)(e);
-    if(le == nullptr)
-        return false;
-    return let_var == le->let_var && rhs->equals(le->rhs) && body->equals(le->body);
+PTR(Expr) LetExpr::make(Symbol let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr){
+    return intern<LetExpr>(Shape(Expr::let_expr, let_var.id, RAW(eq_expr), RAW(in_expr)), let_var, eq_expr, in_expr);
 }
 
-PTR(Val) LetExpr::interp(PTR(Env) env){
-    PTR(Val) rhs_val = rhs->interp(env);
+Value LetExpr::interp(PTR(Env) env){
+    Value rhs_val = rhs->interp(env);
     PTR(Env) new_env = NEW(ExtendedEnv)(let_var, rhs_val, env);
     return body->interp(new_env);
 }
 
-void LetExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::cont = NEW(LetBodyCont)(let_var, body, Step::env, Step::cont);
+void LetExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(rhs);
+    step.push_frame(Frame::let_body, RAW(body), nullptr, let_var);
+}
+
+void LetExpr::compile(PTR(Code) code){
+    rhs->compile(code);
+    code->emit(OP_STORE, code->bind(let_var));
+    body->compile(code);
+    code->unbind();
 }
 
-PTR(Expr) LetExpr::subst(std::string var, PTR(Val) new_val){
+void LetExpr::trace(GC &gc){
+    gc.mark(RAW(rhs));
+    gc.mark(RAW(body));
+}
+
+PTR(Expr) LetExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
     // substitute body only when the variables are not the same
     if(let_var == var)
-        return NEW(LetExpr)(let_var, rhs, body);
+        return LetExpr::make(let_var, rhs->subst(var, new_val), body);
     // always substitute the rhs
-    return NEW(LetExpr)(let_var, rhs->subst(var, new_val), body->subst(var, new_val));
+    return LetExpr::make(let_var, rhs->subst(var, new_val), body->subst(var, new_val));
 }
 
-PTR(Expr) LetExpr::optimize(){
-    rhs = rhs->optimize();
-    body = body->optimize();
-    if(!rhs->containsVar())
-        return body->subst(let_var, rhs->interp(Env::emptyenv))->optimize();
-    return NEW(LetExpr)(let_var, rhs, body);
+PTR(Expr) LetExpr::partial_eval(StaticEnv &known){
+    return partial_eval_let(known, let_var, rhs->partial_eval(known), body);
 }
 
-bool LetExpr::containsVar(){
-    return rhs->containsVar() || body->subst(let_var, rhs->interp(Env::emptyenv))->containsVar();
+std::string LetExpr::to_string(){
+    return "_let " + let_var.to_string() + " = " + rhs->to_string() + " _in " + body->to_string();
 }
 
-std::string LetExpr::to_string(){
-    return "_let " + let_var + " = " + rhs->to_string() + " _in " + body->to_string();
+
+LetRecExpr::LetRecExpr(Symbol let_var, PTR(Expr) fun, PTR(Expr) in_expr){
+    this->kind = Expr::letrec_expr;
+    this->let_var = let_var;
+    this->rhs = fun;
+    this->body = in_expr;
+    // the function's own name is not free in it
+    this->free_vars_cache = union_vars(fun->free_vars(), without_var(in_expr->free_vars(), let_var));
+}
+
+PTR(Expr) LetRecExpr::make(Symbol let_var, PTR(Expr) fun, PTR(Expr) in_expr){
+    PTR(FuncExpr) f = CAST(FuncExpr)(fun);
+    PTR(Expr) named = FuncExpr::make(f->formal_arg, f->body, let_var);
+    return intern<LetRecExpr>(Shape(Expr::letrec_expr, let_var.id, RAW(named), RAW(in_expr)), let_var, named, in_expr);
+}
+
+Value LetRecExpr::interp(PTR(Env) env){
+    return body->interp(NEW(ExtendedEnv)(let_var, rhs->interp(env), env));
+}
+
+void LetRecExpr::step_interp(Step &step){
+    // the function is made in one step, then bound as a `_let` binds
+    step.mode = Step::interp_mode;
+    step.expr = RAW(rhs);
+    step.push_frame(Frame::let_body, RAW(body), nullptr, let_var);
+}
+
+void LetRecExpr::compile(PTR(Code) code){
+    rhs->compile(code);
+    code->emit(OP_STORE, code->bind(let_var));
+    body->compile(code);
+    code->unbind();
+}
+
+void LetRecExpr::trace(GC &gc){
+    gc.mark(RAW(rhs));
+    gc.mark(RAW(body));
+}
+
+PTR(Expr) LetRecExpr::subst(Symbol var, Value new_val){
+    // `let_var` is bound in both parts, so never among the uses
+    if(!uses(var))
+        return THIS;
+    return LetRecExpr::make(let_var, rhs->subst(var, new_val), body->subst(var, new_val));
+}
+
+PTR(Expr) LetRecExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) rhs_opti = rhs->partial_eval(known);
+    // a named function is not inlined, so `let_var` is unknown in the body
+    StaticEnv::Binding shadowed = known.bind(let_var, nullptr);
+    PTR(Expr) body_opti = body->partial_eval(known);
+    known.unbind(let_var, shadowed);
+    if(!body_opti->uses(let_var))
+        return body_opti;
+    return LetRecExpr::make(let_var, rhs_opti, body_opti);
+}
+
+std::string LetRecExpr::to_string(){
+    PTR(FuncExpr) fun = CAST(FuncExpr)(rhs);
+    return "_letrec " + let_var.to_string() + " = _fun (" + fun->formal_arg.to_string() + ") " + fun->body->to_string()
+        + " _in " + body->to_string();
 }
 
 
 IfExpr::IfExpr(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part){
+    this->kind = Expr::if_expr;
     this->test_part = test_part;
     this->then_part = then_part;
     this->else_part = else_part;
+    this->free_vars_cache = union_vars(test_part->free_vars(), union_vars(then_part->free_vars(), else_part->free_vars()));
 }
 
-bool IfExpr::equals(PTR(Expr) e){
-    PTR(IfExpr) ie = CAST(IfExpr)(e);
-    return test_part->equals(ie->test_part) && then_part->equals(ie->then_part) && else_part->equals(ie->else_part);
+PTR(Expr) IfExpr::make(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part){
+    return intern<IfExpr>(Shape(Expr::if_expr, 0, RAW(test_part), RAW(then_part), RAW(else_part)), test_part, then_part, else_part);
 }
 
-PTR(Val) IfExpr::interp(PTR(Env) env){
-    if(test_part->interp(env)->is_ture()){
+Value IfExpr::interp(PTR(Env) env){
+    if(test_part->interp(env).is_ture()){
         return then_part->interp(env);
     }else{
         return else_part->interp(env);
     }
 }
 
-void IfExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = test_part;
-    Step::cont = NEW(IfBranchCont)(then_part, else_part, Step::env, Step::cont);
+void IfExpr::step_interp(Step &step){
+    step.mode = Step::interp_mode;
+    step.expr = RAW(test_part);
+    step.push_frame(Frame::if_branch, RAW(then_part), RAW(else_part));
 }
-    
-PTR(Expr) IfExpr::subst(std::string var, PTR(Val) new_val){
-    return NEW(IfExpr)(test_part->subst(var, new_val), then_part->subst(var, new_val), else_part->subst(var, new_val));
+
+void IfExpr::compile(PTR(Code) code){
+    test_part->compile(code);
+    int to_else = code->emit(OP_JUMP_IF_FALSE, 0);
+    then_part->compile(code);
+    int to_end = code->emit(OP_JUMP, 0);
+    code->patch(to_else);
+    else_part->compile(code);
+    code->patch(to_end);
 }
 
-PTR(Expr) IfExpr::optimize(){
-    PTR(Expr) test_part_op = test_part->optimize();
-    if(test_part_op->equals(NEW(BoolExpr)(true)))
-        return then_part->optimize();
-    else if(test_part_op->equals(NEW(BoolExpr)(false)))
-        return else_part->optimize();
-    else
-        return NEW(IfExpr)(test_part_op, then_part->optimize(), else_part->optimize());
+void IfExpr::trace(GC &gc){
+    gc.mark(RAW(test_part));
+    gc.mark(RAW(then_part));
+    gc.mark(RAW(else_part));
+}
+    
+PTR(Expr) IfExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    return IfExpr::make(test_part->subst(var, new_val), then_part->subst(var, new_val), else_part->subst(var, new_val));
 }
 
-bool IfExpr::containsVar(){
-    return test_part->containsVar() ? true : test_part->interp(Env::emptyenv)->is_ture() ? then_part->containsVar() : else_part->containsVar();
+PTR(Expr) IfExpr::partial_eval(StaticEnv &known){
+    PTR(Expr) test_part_op = test_part->partial_eval(known);
+    if(test_part_op->equals(BoolExpr::make(true)))
+        return then_part->partial_eval(known);
+    else if(test_part_op->equals(BoolExpr::make(false)))
+        return else_part->partial_eval(known);
+    else
+        return IfExpr::make(test_part_op, then_part->partial_eval(known), else_part->partial_eval(known));
 }
 
 std::string IfExpr::to_string(){
     return "_if " + test_part->to_string() + " _then " + then_part->to_string() + " _else " + else_part->to_string();
 }
 
-FuncExpr::FuncExpr(std::string formal_arg, PTR(Expr) body){
+FuncExpr::FuncExpr(Symbol formal_arg, PTR(Expr) body, Symbol self, bool self_applied){
+    this->kind = Expr::func_expr;
     this->formal_arg = formal_arg;
     this->body = body;
+    this->self = self;
+    this->self_applied = self_applied;
+    this->free_vars_cache = without_var(without_var(body->free_vars(), formal_arg), self);
 }
 
-bool FuncExpr::equals(PTR(Expr) e){
-    PTR(FuncExpr) fe = CAST(FuncExpr)(e);
-    return formal_arg == fe->formal_arg && body->equals(fe->body);
+PTR(Expr) FuncExpr::make(Symbol formal_arg, PTR(Expr) body, Symbol self, bool self_applied){
+    return intern<FuncExpr>(Shape(Expr::func_expr, formal_arg.id, RAW(body), nullptr, nullptr, self.id, self_applied),
+                            formal_arg, body, self, self_applied);
 }
 
-PTR(Val) FuncExpr::interp(PTR(Env) env){
-    return NEW(FuncVal)(formal_arg, body, env);
+PTR(Expr) FuncExpr::source(){
+    if(!self_applied)
+        return THIS;
+    return FuncExpr::make(formal_arg, rewrite_self(body, self, false));
 }
 
-void FuncExpr::step_interp(){
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(FuncVal)(formal_arg, body, Step::env);
+Value FuncExpr::interp(PTR(Env) env){
+    return Value::object(NEW(FuncVal)(THIS, capture(env)));
 }
 
-PTR(Expr) FuncExpr::subst(std::string var, PTR(Val) new_val){
-    if(var == formal_arg)
-        return THIS;
-    else
-        return NEW(FuncExpr)(formal_arg, body->subst(var, new_val));
+void FuncExpr::step_interp(Step &step){
+    step.mode = Step::continue_mode;
+    step.val = Value::object(NEW(FuncVal)(THIS, capture(step.env)));
 }
 
-PTR(Expr) FuncExpr::optimize(){
-    return NEW(FuncExpr)(formal_arg, body->optimize());
+void FuncExpr::compile(PTR(Code) code){
+    int func = code->add_func(formal_arg, body, free_vars(), self, self_applied);
+    // push the captured values, OP_FUNC copies them into the closure
+    const std::vector<Symbol> &captured = code->funcs[func].captured;
+    for(size_t i = 0; i < captured.size(); i++)
+        code->emit_load(captured[i]);
+    code->emit(OP_FUNC, func);
 }
 
-bool FuncExpr::containsVar(){
-    return body->containsVar();
+void FuncExpr::trace(GC &gc){
+    gc.mark(RAW(body));
+}
+
+PTR(Env) FuncExpr::capture(PTR(Env) env){
+    // keep only what the body can refer to, not the whole chain
+    if(free_vars().empty())
+        return Env::emptyenv;
+    return NEW(FlatEnv)(free_vars(), env);
+}
+
+PTR(Expr) FuncExpr::subst(Symbol var, Value new_val){
+    if(!uses(var))
+        return THIS;
+    else
+        return FuncExpr::make(formal_arg, body->subst(var, new_val), self, self_applied);
+}
+
+PTR(Expr) FuncExpr::partial_eval(StaticEnv &known){
+    // a named function's own name is as unknown in its body as the argument
+    bool named = self != Symbol();
+    StaticEnv::Binding shadowed_self = named ? known.bind(self, nullptr) : StaticEnv::Binding{nullptr, 0};
+    StaticEnv::Binding shadowed = known.bind(formal_arg, nullptr);
+    PTR(Expr) body_opti = body->partial_eval(known);
+    known.unbind(formal_arg, shadowed);
+    if(named)
+        known.unbind(self, shadowed_self);
+    return FuncExpr::make(formal_arg, body_opti, self, self_applied);
 }
 
 std::string FuncExpr::to_string(){
-    return "_fun (" + formal_arg + ") " + body->to_string();
+    if(self_applied)
+        return source()->to_string();
+    std::string fun = "_fun (" + formal_arg.to_string() + ") " + body->to_string();
+    // a `_letrec`'s function is read back as one
+    if(self != Symbol())
+        return "_letrec " + self.to_string() + " = " + fun + " _in " + self.to_string();
+    return fun;
 }
 
 
 TEST_CASE( "equals" ) {
-    CHECK( (NEW(NumExpr)(1))->equals(NEW(NumExpr)(1)) );
-    CHECK( ! (NEW(NumExpr)(1))->equals(NEW(NumExpr)(2)) );
-    CHECK( ! (NEW(NumExpr)(1))->equals(NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(4))) );
-    CHECK( (NEW(VarExpr)("x"))->equals(NEW(VarExpr)("x")) );
-    CHECK( ! (NEW(VarExpr)("x"))->equals(NEW(NumExpr)(5)) );
+    CHECK( (NumExpr::make(1))->equals(NumExpr::make(1)) );
+    CHECK( ! (NumExpr::make(1))->equals(NumExpr::make(2)) );
+    CHECK( ! (NumExpr::make(1))->equals(MultExpr::make(NumExpr::make(2), NumExpr::make(4))) );
+    CHECK( (VarExpr::make("x"))->equals(VarExpr::make("x")) );
+    CHECK( ! (VarExpr::make("x"))->equals(NumExpr::make(5)) );
     
-    CHECK( (NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(9)))
-          ->equals(NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(9))) );
-    CHECK( ! (NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(9)))
-          ->equals(NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(10))) );
-    CHECK( ! (NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(9)))
-          ->equals(NEW(AddExpr)(NEW(NumExpr)(10), NEW(NumExpr)(9))) );
-    CHECK( ! (NEW(AddExpr)(NEW(NumExpr)(8), NEW(NumExpr)(9)))
-          ->equals(NEW(NumExpr)(8)) );
+    CHECK( (AddExpr::make(NumExpr::make(8), NumExpr::make(9)))
+          ->equals(AddExpr::make(NumExpr::make(8), NumExpr::make(9))) );
+    CHECK( ! (AddExpr::make(NumExpr::make(8), NumExpr::make(9)))
+          ->equals(AddExpr::make(NumExpr::make(8), NumExpr::make(10))) );
+    CHECK( ! (AddExpr::make(NumExpr::make(8), NumExpr::make(9)))
+          ->equals(AddExpr::make(NumExpr::make(10), NumExpr::make(9))) );
+    CHECK( ! (AddExpr::make(NumExpr::make(8), NumExpr::make(9)))
+          ->equals(NumExpr::make(8)) );
+    // nodes of another kind are never equal
+    CHECK( ! (IfExpr::make(BoolExpr::make(true), NumExpr::make(1), NumExpr::make(2)))->equals(NumExpr::make(1)) );
+    CHECK( ! (FuncExpr::make("x", VarExpr::make("x")))->equals(VarExpr::make("x")) );
+    CHECK( ! (CallExpr::make(VarExpr::make("f"), NumExpr::make(1)))->equals(EquExpr::make(VarExpr::make("f"), NumExpr::make(1))) );
+    CHECK( ! (EquExpr::make(NumExpr::make(1), NumExpr::make(1)))->equals(AddExpr::make(NumExpr::make(1), NumExpr::make(1))) );
+}
+
+TEST_CASE( "hash consing" ) {
+    PTR(Expr) e = parse_str("_let y = 2 + 3 _in _fun (x) x * (2 + 3)");
+    CHECK( RAW(e) == RAW(parse_str("_let y = 2 + 3 _in _fun (x) x * (2 + 3)")) );
+    PTR(Expr) sum = CAST(LetExpr)(e)->rhs;
+    CHECK( RAW(sum) == RAW(CAST(MultExpr)(CAST(FuncExpr)(CAST(LetExpr)(e)->body)->body)->rhs) );
+    CHECK( sum->hash == AddExpr::make(NumExpr::make(2), NumExpr::make(3))->hash );
+    CHECK( sum->id != NumExpr::make(2)->id );
+    CHECK( ! sum->equals(AddExpr::make(NumExpr::make(3), NumExpr::make(2))) );
+
+    // Rebuilding a node, or optimizing what is optimized already, makes nothing new
+    PTR(Expr) opt = e->optimize();
+    size_t interned = Expr::interned();
+    CHECK( RAW(opt->optimize()) == RAW(opt) );
+    CHECK( RAW(e->subst("z", Value::num(1))) == RAW(e) );
+    CHECK( Expr::interned() == interned );
     
+#if !ENABLE_GC && !ENABLE_ARENA && !ENABLE_SMART_POINTER
+    // Nodes only the table holds are dropped, and made again when needed
+    Expr::release();
+    interned = Expr::interned();
+    size_t id = sum->id;
+    {
+        PTR(Expr) unused = parse_str("_let unused = 40 + 2 _in unused * (2 + 3)");
+        CHECK( Expr::interned() > interned );
+        CHECK( Expr::release() == 0 );
+    }
+    CHECK( Expr::release() > 0 );
+    CHECK( Expr::interned() == interned );
+    CHECK( RAW(AddExpr::make(NumExpr::make(2), NumExpr::make(3))) == RAW(sum) );
+    CHECK( sum->id == id );
+    CHECK( Expr::interp_by_tree(parse_str("_let unused = 40 + 2 _in unused * (2 + 3)")).equals(Value::num(210)) );
+#endif
 }
 
 TEST_CASE( "value") {
-    CHECK( (NEW(NumExpr)(10))->interp(Env::emptyenv)->equals(NEW(NumVal)(10)) );
-    CHECK( (NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(2)))->interp(Env::emptyenv)
-          ->equals(NEW(NumVal)(5)) );
-    CHECK( (NEW(MultExpr)(NEW(NumExpr)(3), NEW(NumExpr)(2)))->interp(Env::emptyenv)
-          ->equals(NEW(NumVal)(6)) );
+    CHECK( (NumExpr::make(10))->interp(Env::emptyenv).equals(Value::num(10)) );
+    CHECK( (AddExpr::make(NumExpr::make(3), NumExpr::make(2)))->interp(Env::emptyenv)
+          .equals(Value::num(5)) );
+    CHECK( (MultExpr::make(NumExpr::make(3), NumExpr::make(2)))->interp(Env::emptyenv)
+          .equals(Value::num(6)) );
 }
 
 TEST_CASE( "subst") {
-    CHECK( (NEW(NumExpr)(10))->subst("dog", NEW(NumVal)(3))
-          ->equals(NEW(NumExpr)(10)) );
-    CHECK( (NEW(VarExpr)("fish"))->subst("dog", NEW(NumVal)(3))
-          ->equals(NEW(VarExpr)("fish")) );
-    CHECK( (NEW(VarExpr)("dog"))->subst("dog", NEW(NumVal)(3) )
-          ->equals(NEW(NumExpr)(3) ) );
-    CHECK( (NEW(AddExpr)(NEW(NumExpr)(2), NEW(VarExpr)("dog")))->subst("dog", NEW(NumVal)(3))
-          ->equals(NEW(AddExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))) );
-    CHECK( (NEW(MultExpr)(NEW(NumExpr)(2), NEW(VarExpr)("dog")))->subst("dog", NEW(NumVal)(3))
-          ->equals(NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))) );
+    CHECK( (NumExpr::make(10))->subst("dog", Value::num(3))
+          ->equals(NumExpr::make(10)) );
+    CHECK( (VarExpr::make("fish"))->subst("dog", Value::num(3))
+          ->equals(VarExpr::make("fish")) );
+    CHECK( (VarExpr::make("dog"))->subst("dog", Value::num(3) )
+          ->equals(NumExpr::make(3) ) );
+    CHECK( (AddExpr::make(NumExpr::make(2), VarExpr::make("dog")))->subst("dog", Value::num(3))
+          ->equals(AddExpr::make(NumExpr::make(2), NumExpr::make(3))) );
+    CHECK( (MultExpr::make(NumExpr::make(2), VarExpr::make("dog")))->subst("dog", Value::num(3))
+          ->equals(MultExpr::make(NumExpr::make(2), NumExpr::make(3))) );
+    // only where the variable is free
+    CHECK( parse_str("_let x = x _in x + y")->subst("x", Value::num(1))
+          ->equals(parse_str("_let x = 1 _in x + y")) );
+    CHECK( parse_str("f(x)")->subst("x", Value::num(1))->equals(parse_str("f(1)")) );
+}
+
+TEST_CASE( "optimize") {
+    CHECK( parse_str("_let x = 2 + 3 _in _fun (y) y + x * (2 + 3)")->optimize()
+          ->equals(parse_str("_fun (y) y + 25")) );
+    CHECK( parse_str("_if 1 == 2 _then x _else y * (1 + 1)")->optimize()
+          ->equals(parse_str("y * 2")) );
+    // functions are not folded: equal ones may stop being equal once their bodies are optimized
+    CHECK( parse_str("(_fun (x) x) == (_fun (x) x)")->optimize()->equals(parse_str("(_fun (x) x) == (_fun (x) x)")) );
+    CHECK( parse_str("_let a = 1 _in _let f = _fun (x) x + a _in _let a = 2 _in _let g = _fun (x) x + a _in f == g")
+          ->optimize()->equals(parse_str("_let f = _fun (x) x + 1 _in _let g = _fun (x) x + 2 _in f == g")) );
+    CHECK( parse_str("_let f = _fun (x) _fun (y) x + y _in f(3) == f(4)")->optimize()
+          ->equals(parse_str("(_fun (y) 3 + y) == (_fun (y) 4 + y)")) );
+    // and what would fail at run time is left to fail there
+    CHECK( parse_str("_let g = _fun (x) x _in _fun (y) g + 1")->optimize()
+          ->equals(parse_str("_let g = _fun (x) x _in _fun (y) g + 1")) );
+    CHECK( parse_str("_fun (y) (1 + _true) * (_false * 2)")->optimize()
+          ->equals(parse_str("_fun (y) (1 + _true) * (_false * 2)")) );
+    CHECK( parse_str("1 == _true")->optimize()->equals(BoolExpr::make(false)) );
+    // calls of known functions are replaced by their bodies
+    CHECK( parse_str("_let f = _fun (x) x + 1 _in f(2) == 3")->optimize()->equals(BoolExpr::make(true)) );
+    CHECK( parse_str("_let f = _fun (x) _fun (y) x + y _in _let g = f(5) _in g(1)")->optimize()
+          ->equals(NumExpr::make(6)) );
+    CHECK( parse_str("_let sq = _fun (x) x * x _in (_fun (a) _fun (b) a + b)(sq(3))(sq(4))")->optimize()
+          ->equals(NumExpr::make(25)) );
+    CHECK( parse_str("(_fun (x) x + 1)(y * 2)")->optimize()->equals(parse_str("_let x = y * 2 _in x + 1")) );
+    // finding free variables runs no code
+    CHECK( !parse_str("_if _true + 1 _then 1 _else 2")->containsVar() );
+    CHECK( parse_str("_if _true _then 1 _else x")->containsVar() );
+    // known bindings are put in under functions, and shadowed ones are not
+    CHECK( parse_str("_let a = 2 _in _fun (y) y * a")->optimize()->equals(parse_str("_fun (y) y * 2")) );
+    CHECK( parse_str("_let x = 1 _in _fun (x) x + 1")->optimize()->equals(parse_str("_fun (x) x + 1")) );
+    CHECK( parse_str("_let x = 1 _in _let x = y _in x + x")->optimize()->equals(parse_str("_let x = y _in x + x")) );
+    CHECK( parse_str("_let x = 1 _in _let y = x + z _in x + y")->optimize()->equals(parse_str("_let y = 1 + z _in 1 + y")) );
+
+    // a function with free variables is inlined where they mean the same
+    CHECK( parse_str("_fun (k) _let f = _fun (x) x * k _in f(2) + f(3)")->optimize()
+          ->equals(parse_str("_fun (k) 2 * k + 3 * k")) );
+    CHECK( parse_str("_fun (k) _let f = _fun (x) x * k _in _fun (k) f(2)")->optimize()
+          ->equals(parse_str("_fun (k) _let f = _fun (x) x * k _in _fun (k) f(2)")) );
+    // recursion is not unrolled, and big functions are left alone
+    CHECK( parse_str("(_fun (f) f(f))(_fun (f) f(f))")->optimize()
+          ->equals(parse_str("_let f = _fun (f) f(f) _in f(f)")) );
+    PTR(Expr) fib = parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 2 + -1 _then 1"
+                              "                   _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                              "_in fib(fib)(10)");
+    CHECK( Expr::interp_by_tree(fib->optimize()).equals(Value::num(89)) );
+    size_t inline_size = StaticEnv::inline_size;
+    StaticEnv::inline_size = 2;
+    CHECK( parse_str("(_fun (x) x + 1)(2)")->optimize()->equals(parse_str("(_fun (x) x + 1)(2)")) );
+    StaticEnv::inline_size = inline_size;
+
+    // a let chain is optimized in one pass over it; x, xx, ... are bound in turn
+    std::string chain = "x";
+    for(int i = 1; i <= 40; i++)
+        chain = "_let " + std::string(i, 'x') + " = " + std::string(i + 1, 'x') + " + 1 _in " + chain;
+    CHECK( parse_str("_let " + std::string(41, 'x') + " = 0 _in " + chain)->optimize()->equals(NumExpr::make(40)) );
+    CHECK( parse_str(chain)->optimize()->free_vars() == std::vector<Symbol>{std::string(41, 'x')} );
+    // without copying the rest of the chain for each binding: the only nodes made are the sums
+    chain = "z";
+    for(int i = 1; i <= 200; i++)
+        chain = "_let " + std::string(i, 'z') + " = " + std::string(i + 1, 'z') + " + 1 _in " + chain;
+    PTR(Expr) program = parse_str("_let " + std::string(201, 'z') + " = 1000 _in " + chain);
+    size_t interned = Expr::interned();
+    CHECK( program->optimize()->equals(NumExpr::make(1200)) );
+    CHECK( Expr::interned() - interned <= 200 );
+}
+
+TEST_CASE( "lower recursion") {
+    PTR(Expr) fib = parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+                              " _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)");
+    PTR(LetExpr) let = CAST(LetExpr)(Expr::lower_recursion(fib));
+    REQUIRE( let != nullptr );
+    CHECK( let->body->equals(parse_str("fib(10)")) );
+    PTR(FuncExpr) fun = CAST(FuncExpr)(let->rhs);
+    REQUIRE( fun != nullptr );
+    CHECK( fun->self == "fib" );
+    CHECK( fun->formal_arg == "x" );
+    CHECK( fun->free_vars().empty() );
+    CHECK( fun->body->equals(parse_str("_if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(x + -1) + fib(x + -2)")) );
+    CHECK( fun->source()->equals(CAST(FuncExpr)(CAST(LetExpr)(fib)->rhs)->body) );
+    CHECK( Expr::interp_by_tree(fib).equals(Value::num(89)) );
+    CHECK( Step::interp_by_steps(fib).equals(Value::num(89)) );
+    CHECK( VM::interp_by_vm(fib).equals(Value::num(89)) );
+    
+    // the function prints and compares as the one `f(f)` made
+    std::string countdown = "_let f = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) _in ";
+    PTR(Expr) made = parse_str("_fun (n) _if n == 0 _then 0 _else f(f)(n + -1)");
+    CHECK( Expr::interp_by_tree(parse_str(countdown + "f(f)")).to_expr()->equals(made) );
+    CHECK( Step::interp_by_steps(parse_str(countdown + "f(f)")).to_expr()->equals(made) );
+    CHECK( VM::interp_by_vm(parse_str(countdown + "f(f)")).to_expr()->equals(made) );
+    CHECK( VM::interp_by_vm(parse_str(countdown + "f(f)")).to_string() == made->to_string() );
+    CHECK( Expr::interp_by_tree(parse_str(countdown + "f(f) == f(f)")).equals(Value::boolean(true)) );
+    CHECK( Expr::interp_by_tree(parse_str(countdown + "_let g = f(f) _in g(1000)")).equals(Value::num(0)) );
+    // a name the body binds again is another variable
+    CHECK( VM::interp_by_vm(parse_str("_let f = _fun (f) _fun (x) _if x == 0 _then (_fun (f) f + 1)(5) _else f(f)(x + -1) _in f(f)(3)"))
+          .equals(Value::num(6)) );
+    
+    // left as written: `f` used other than applied to itself, or inside another function
+    const char *kept[] = {
+        "_let f = _fun (f) _fun (x) f _in f(f)(1)",
+        "_let f = _fun (f) _fun (x) x _in f(f)(1)",
+        "_let f = _fun (g) _fun (x) g(g)(x) _in f",
+        "_let f = _fun (f) _fun (f) f(f) _in f(f)",
+        "_let f = _fun (f) _fun (x) _fun (y) f(f)(x) _in f(f)(1)",
+    };
+    for(const char *program : kept)
+        CHECK( Expr::lower_recursion(parse_str(program))->equals(parse_str(program)) );
+    CHECK( Expr::interp_by_tree(parse_str(countdown + "f(f) == _fun (n) _if n == 0 _then 0 _else f(f)(n + -1)"))
+          .equals(Value::boolean(true)) );
+}
+
+
+TEST_CASE( "letrec") {
+    PTR(Expr) fib = parse_str("_letrec fib = _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1"
+                              " _else fib(x + -1) + fib(x + -2) _in fib(10)");
+    PTR(LetRecExpr) let = CAST(LetRecExpr)(fib);
+    REQUIRE( let != nullptr );
+    CHECK( CAST(FuncExpr)(let->rhs)->self == "fib" );
+    CHECK( fib->free_vars().empty() );
+    CHECK( fib->interp(Env::emptyenv).equals(Value::num(89)) );
+    CHECK( Step::interp_by_steps(fib).equals(Value::num(89)) );
+    CHECK( VM::interp_by_vm(fib).equals(Value::num(89)) );
+    CHECK( Expr::interp_by_tree(fib->optimize()).equals(Value::num(89)) );
+    CHECK( VM::interp_by_vm(parse_str("_letrec countdown = _fun (n) _if n == 0 _then 0 _else countdown(n + -1)"
+                                      " _in countdown(1000000)")).equals(Value::num(0)) );
+    
+    // what the function captures, and the argument hiding its name
+    PTR(Expr) captures = parse_str("_let a = 2 _in _letrec f = _fun (x) _if x == 0 _then a _else f(x + -1) _in f(3)");
+    CHECK( Expr::interp_by_tree(captures).equals(Value::num(2)) );
+    CHECK( Step::interp_by_steps(captures).equals(Value::num(2)) );
+    CHECK( VM::interp_by_vm(captures).equals(Value::num(2)) );
+    PTR(Expr) shadowed = parse_str("_letrec f = _fun (f) f + 1 _in f(1)");
+    CHECK( Expr::interp_by_tree(shadowed).equals(Value::num(2)) );
+    CHECK( Step::interp_by_steps(shadowed).equals(Value::num(2)) );
+    CHECK( VM::interp_by_vm(shadowed).equals(Value::num(2)) );
+    CHECK( parse_str("_letrec f = _fun (x) f(y) _in f(z)")->free_vars() == parse_str("y + z")->free_vars() );
+    CHECK_THROWS_WITH( parse_str("_letrec f = 1 _in f"), "_letrec should bind a function" );
+    
+    // the function prints as the `_letrec` that made it, and works out of its run
+    PTR(Expr) loop = parse_str("_letrec f = _fun (x) f(x) _in f");
+    CHECK( parse_str(loop->to_string())->equals(loop) );
+    CHECK( Expr::interp_by_tree(loop).to_string() == "_letrec f = _fun (x) f(x) _in f" );
+    CHECK( VM::interp_by_vm(loop).to_string() == "_letrec f = _fun (x) f(x) _in f" );
+    CHECK( Expr::interp_by_tree(parse_str("_letrec f = _fun (x) f(x) _in f == f")).equals(Value::boolean(true)) );
+    CHECK( loop->optimize()->to_string() == "_letrec f = _fun (x) f(x) _in f" );
+    Value fun = Expr::interp_by_tree(parse_str("_letrec f = _fun (n) _if n == 0 _then _true _else f(n + -1) _in _let x = f(10) _in f"));
+    CHECK( fun.call(Value::num(5)).equals(Value::boolean(true)) );
+#if !ENABLE_GC && !ENABLE_ARENA && !ENABLE_SMART_POINTER
+    // nothing the function holds points back to it, so counting frees it
+    CHECK( UNIQUE(fun.obj) );
+#endif
+}
+
+TEST_CASE( "free variables") {
+    PTR(FuncExpr) f = CAST(FuncExpr)(parse_str("_fun (x) _let y = x + a _in y * b(c) + _fun (b) b + d"));
+    std::set<Symbol> expected = {"a", "b", "c", "d"};
+    CHECK( std::set<Symbol>(f->free_vars().begin(), f->free_vars().end()) == expected );
+    CHECK( CAST(FuncExpr)(parse_str("_fun (x) x + 1"))->free_vars().empty() );
+    
+    // the closure keeps `a`, not `b` or the rest of the chain
+    Value fun = parse_str("_let a = 1 _in _let b = 2 _in _fun (x) x + a")->interp(Env::emptyenv);
+    PTR(FuncVal) fv = CAST(FuncVal)(fun.obj);
+    REQUIRE( fv != nullptr );
+    PTR(FlatEnv) captured = CAST(FlatEnv)(fv->env);
+    REQUIRE( captured != nullptr );
+    REQUIRE( captured->size == 1 );
+    CHECK( captured->binding(0).name == "a" );
+    CHECK( fun.call(Value::num(4)).equals(Value::num(5)) );
+    // a name free at creation is only an error once it is used
+    CHECK_THROWS_WITH( parse_str("_let f = _fun (x) y _in f(1)")->interp(Env::emptyenv), "free variabley" );
+    CHECK( Step::interp_by_steps(parse_str("_let a = 3 _in _let f = _fun (x) x * a _in f(2)")).equals(Value::num(6)) );
+}
+
+TEST_CASE( "threads") {
+#if ENABLE_REFCOUNT || ENABLE_GC
+    // Counts and the heap are not safe to share, so only the thread that made the first node makes more
+    NumExpr::make(1);
+    std::string error;
+    std::thread other([&]() {
+        try {
+            NumExpr::make(2);
+        } catch (std::runtime_error &e) {
+            error = e.what();
+        }
+    });
+    other.join();
+    CHECK( error == "expressions are used by one thread with ENABLE_REFCOUNT or ENABLE_GC" );
+    CHECK( NumExpr::make(2)->equals(NumExpr::make(2)) );
+#else
+    // Each run has its own state, so threads can run one program at once,
+    // and make nodes, some of them the same ones, while they do
+    std::string text = "_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1"
+                       "                   _else fib(fib)(n + -1) + fib(fib)(n + -2)"
+                       "_in fib(fib)(15) + ";
+    PTR(Expr) fib = parse_str(text + "0");
+    CHECK( Expr::interp_by_tree(fib).equals(Value::num(610)) );
+    std::atomic<int> right(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 8; i++)
+        threads.emplace_back([&, i]() {
+            for(int j = 0; j < 20; j++){
+                if(Expr::interp_by_tree(fib).equals(Value::num(610)))
+                    right++;
+                PTR(Expr) own = parse_str(text + std::to_string(i * 100 + j));
+                if(Expr::interp_by_tree(own->optimize()).equals(Value::num(610 + i * 100 + j)))
+                    right++;
+            }
+        });
+    for(std::thread &t : threads)
+        t.join();
+    CHECK( right == 8 * 20 * 2 );
+#endif
 }
-
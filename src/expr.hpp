@@ -10,26 +10,162 @@
 #define expr_h
 
 #include <string>
+#include <set>
+#include <vector>
 #include "pointer.hpp"
+#include "symbol.hpp"
 
-class Val;
+class Value;
 class Env;
+class Code;
+class Step;
+class GC;
+class Expr;
+class FuncExpr;
+
+/* What the optimizer knows about the variables in scope:
+ the constant or the function each one is bound to, or
+ nothing where it is unknown. Values are kept by symbol id
+ and replaced while a binding is in scope, so looking one
+ up takes constant time however deep the scopes are nested.
+ 
+ It also keeps what inlining needs. A call of a function
+ known at the call site is replaced by the function's body
+ with the argument bound by a `_let`, which evaluates it
+ first just as the call would, so no argument is copied.
+ The body's free variables must still mean what they meant
+ where the function was bound: a function is not inlined
+ where one of them has been bound again since. Nor is one
+ inlined inside its own inlining, nor when it is bigger
+ than `inline_size` nodes or the program's `budget` of
+ inlined nodes is spent, so recursion ends and code grows
+ by a bounded amount. */
+class StaticEnv {
+public:
+    struct Binding {
+        PTR(Expr) val;   // a constant, a function, or nullptr if unknown
+        size_t time;     // when the binding was made
+    };
+    
+    // Functions bigger than this, in nodes, are not inlined
+    static size_t inline_size;
+    // Nodes that inlining may add to one program
+    static size_t inline_budget;
+    
+    size_t budget;
+    
+    StaticEnv();
+    // The constant `var` is bound to, or nullptr if unknown
+    PTR(Expr) lookup(Symbol var);
+    // The function to inline for a call of `var`, or nullptr
+    PTR(FuncExpr) function(Symbol var);
+    // Bind `var` to `val`, or to nothing, returning what it shadows
+    Binding bind(Symbol var, PTR(Expr) val);
+    // Put back what `bind` returned once the binding is out of scope
+    void unbind(Symbol var, Binding shadowed);
+    // Whether a call of `fun` may be replaced by its body here
+    bool can_inline(PTR(FuncExpr) fun);
+    
+    // Marks `fun` as being inlined until the end of the scope
+    class Inlining {
+    public:
+        Inlining(StaticEnv &known, PTR(FuncExpr) fun);
+        ~Inlining();
+    private:
+        StaticEnv &known;
+    };
+    
+private:
+    std::vector<Binding> vals;
+    size_t clock;
+    std::vector<FuncExpr*> inlining;
+};
 
 class Expr ENABLE_THIS(Expr){
 public:
-    virtual bool equals(PTR(Expr) e) = 0;
+    // Which subclass this is, so type checks need no RTTI
+    typedef enum {
+        num_expr,
+        equ_expr,
+        add_expr,
+        mult_expr,
+        var_expr,
+        bool_expr,
+        call_expr,
+        let_expr,
+        if_expr,
+        func_expr,
+        letrec_expr
+    } kind_t;
+    
+    kind_t kind;
+    /* Nodes are hash-consed: every node is made by its
+     class's `make`, which returns the existing node when
+     one of the same shape exists, so structurally equal
+     expressions are one node and never change. The table
+     of them is locked while a node is made, so any thread
+     can make them, but with ENABLE_REFCOUNT or ENABLE_GC,
+     whose counts and heap are not shared safely, only the
+     thread that made the first one may. `hash` is computed from the structure
+     when the node is made, and `id` is a small number no
+     other node has while it lives; a released node's id is
+     given to a later one. */
+    size_t hash;
+    size_t id;
+    size_t size;  // nodes in the tree, counting shared ones each time
+    
+    // Structural equality, which hash-consing makes identity
+    bool equals(PTR(Expr) e) { return RAW(e) == this; }
+    // The distinct nodes in the table
+    static size_t interned();
+    /* Drop the nodes that nothing but the table points to,
+     so a host that runs many programs can free the old
+     ones, and return how many. Where pointers are not
+     counted (ENABLE_GC, ENABLE_ARENA, ENABLE_SMART_POINTER)
+     this is not known, and every node is kept. */
+    static size_t release();
     // Compute the value of an expression
-    virtual PTR(Val) interp(PTR(Env) env) = 0;
+    virtual Value interp(PTR(Env) env) = 0;
+    /* Interpret a whole program in the empty environment,
+     after `lower_recursion`, allocating in a fresh arena
+     (see arena.hpp) that is released when it returns */
+    static Value interp_by_tree(PTR(Expr) e);
     // step for continuation
-    virtual void step_interp() = 0;
+    virtual void step_interp(Step &step) = 0;
+    // Append bytecode for the VM
+    virtual void compile(PTR(Code) code) = 0;
+    /* The variables the expression uses without binding
+     them, in symbol order. Nodes never change, so each
+     constructor works them out once from its children's. */
+    const std::vector<Symbol> &free_vars() { return free_vars_cache; }
+    // Whether `var` is among them
+    bool uses(Symbol var);
+    // Mark the objects it points to (see gc.hpp)
+    virtual void trace(GC &gc) = 0;
     // Substitute a number in place of a variable
-    virtual PTR(Expr) subst(std::string var, PTR(Val) new_val) = 0;
-    // Optimize the code to make it easy to deal with
-    virtual PTR(Expr) optimize() = 0;
-    // Return if the current expresssion contians variable
-    virtual bool containsVar() = 0;
+    virtual PTR(Expr) subst(Symbol var, Value new_val) = 0;
+    /* Optimize the code to make it easy to deal with: a
+     partial evaluation of the whole expression, with no
+     variable known to begin with */
+    PTR(Expr) optimize();
+    /* The expression with what `known` says about its
+     variables put in and everything that can be computed
+     from them computed, visiting each node once */
+    virtual PTR(Expr) partial_eval(StaticEnv &known) = 0;
+    /* The program with each function that recurses by
+     applying itself to itself made directly recursive:
+     `_let f = _fun (f) _fun (x) ... f(f) ... _in ... f(f) ...`
+     where `f` is used only in `f(f)` becomes `f` bound to
+     `_fun (x) ...` named `f`, with each `f(f)` just `f`, so
+     a recursive call no longer makes a closure first. */
+    static PTR(Expr) lower_recursion(PTR(Expr) e);
+    // Return if the current expresssion contians a free variable
+    bool containsVar() { return !free_vars_cache.empty(); }
     // Get expression as a string format
     virtual std::string to_string() = 0;
+    
+protected:
+    std::vector<Symbol> free_vars_cache;
 };
 
 class NumExpr : public Expr {
@@ -38,12 +174,13 @@ public:
     // PTR(Val) val; // allocate only once instead of everytime in interpret
     
     NumExpr(int val);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(int val);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -53,12 +190,13 @@ public:
     PTR(Expr) rhs;
     
     EquExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(PTR(Expr) lhs, PTR(Expr) rhs);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -68,12 +206,13 @@ public:
     PTR(Expr) rhs;
     
     AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(PTR(Expr) lhs, PTR(Expr) rhs);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -83,26 +222,28 @@ public:
     PTR(Expr) rhs;
     
     MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(PTR(Expr) lhs, PTR(Expr) rhs);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
 class VarExpr : public Expr{
 public:
-    std::string name;
+    Symbol name;
     
-    VarExpr(std::string name);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    VarExpr(Symbol name);
+    static PTR(Expr) make(Symbol name);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -111,12 +252,13 @@ public:
     bool val;
     
     BoolExpr(bool val);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(bool val);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -126,28 +268,53 @@ public:
     PTR(Expr) actual_arg;
     
     CallExpr(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(PTR(Expr) to_be_called, PTR(Expr) actual_arg);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
 class LetExpr : public Expr{
 public:
-    std::string let_var;
+    Symbol let_var;
     PTR(Expr) rhs;
     PTR(Expr) body;
     
-    LetExpr(std::string let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    LetExpr(Symbol let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr);
+    static PTR(Expr) make(Symbol let_var, PTR(Expr) eq_expr, PTR(Expr) in_expr);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
+    std::string to_string();
+};
+
+/* `_letrec let_var = _fun (x) ... _in body`: the function
+ is named `let_var` (see FuncExpr::self), so its body calls
+ it by that name, and is bound to `let_var` in `body` as a
+ `_let` would. The name is bound in each call's frame, not
+ patched into the closure, so no cycle is made. */
+class LetRecExpr : public Expr{
+public:
+    Symbol let_var;
+    PTR(Expr) rhs;   // a FuncExpr named `let_var`
+    PTR(Expr) body;
+    
+    LetRecExpr(Symbol let_var, PTR(Expr) fun, PTR(Expr) in_expr);
+    // `fun` must be a FuncExpr; it is named `let_var`
+    static PTR(Expr) make(Symbol let_var, PTR(Expr) fun, PTR(Expr) in_expr);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
@@ -158,28 +325,44 @@ public:
     PTR(Expr) else_part;
     
     IfExpr(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    static PTR(Expr) make(PTR(Expr) test_part, PTR(Expr) then_part, PTR(Expr) else_part);
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
 };
 
 class FuncExpr : public Expr{
 public:
-    std::string formal_arg;
+    Symbol formal_arg;
     PTR(Expr) body;
+    /* The name the body calls the function itself by, bound
+     in each call's frame, or no name: the variable of a
+     `_letrec`, or, for `Expr::lower_recursion`, the `f` of
+     the `f(f)` it replaced, which `self_applied` tells. */
+    Symbol self;
+    bool self_applied;
     
-    FuncExpr(std::string formal_arg, PTR(Expr) body);
-    bool equals(PTR(Expr) e);
-    PTR(Val) interp(PTR(Env) env);
-    void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
-    PTR(Expr) optimize();
-    bool containsVar();
+    FuncExpr(Symbol formal_arg, PTR(Expr) body, Symbol self, bool self_applied);
+    static PTR(Expr) make(Symbol formal_arg, PTR(Expr) body, Symbol self = Symbol(), bool self_applied = false);
+    /* The function as it was written: if it was named by
+     `lower_recursion`, each use of `self` in the body is
+     `self(self)` again */
+    PTR(Expr) source();
+    Value interp(PTR(Env) env);
+    void step_interp(Step &step);
+    void compile(PTR(Code) code);
+    void trace(GC &gc);
+    PTR(Expr) subst(Symbol var, Value new_val);
+    PTR(Expr) partial_eval(StaticEnv &known);
     std::string to_string();
+    
+private:
+    // Environment for a closure of this function created in `env`
+    PTR(Env) capture(PTR(Env) env);
 };
 
 #endif /* expr_h */
@@ -0,0 +1,275 @@
+//
+//  gc.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/16/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "gc.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "expr.hpp"
+#include "step.hpp"
+#include "vm.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+GC &GC::heap() {
+    // Never destroyed, so static roots can unregister at exit
+    static GC *gc = new GC();
+    return *gc;
+}
+
+void GC::mark(Value val) {
+    if (val.kind == Value::obj_kind)
+        mark(RAW(val.obj));
+}
+
+#if ENABLE_GC
+void GC::track(Managed *obj, size_t size) {
+    obj->gc_next = young;
+    obj->gc_seq = next_seq++;
+    obj->gc_size = (unsigned)size;
+    obj->gc_epoch = 0;
+    obj->gc_marked = false;
+    obj->gc_remembered = false;
+    young = obj;
+    count++;
+    young_bytes += size;
+}
+
+void GC::add_roots(void *owner, trace_fn trace) {
+    RootSet r = {owner, trace};
+    roots.push_back(r);
+}
+
+void GC::remove_roots(void *owner) {
+    // Roots mostly come and go like a stack
+    for (size_t i = roots.size(); i-- > 0; ) {
+        if (roots[i].owner == owner) {
+            roots.erase(roots.begin() + i);
+            return;
+        }
+    }
+}
+
+void GC::mark(Managed *obj) {
+    if (obj == nullptr || obj->gc_seq < mark_from || obj->gc_seq >= mark_to)
+        return;
+    if (minor) {
+        if (!obj->gc_marked) {
+            obj->gc_marked = true;
+            minor_grey.push_back(obj);
+        }
+    } else if (obj->gc_epoch != epoch) {
+        obj->gc_epoch = epoch;
+        major_grey.push_back(obj);
+    }
+}
+
+void GC::free(Managed *obj) {
+    delete obj;
+    count--;
+    nfreed++;
+}
+
+void GC::collect_some(size_t region) {
+    if (young_bytes >= nursery_size)
+        collect_minor(region);
+    if (phase == idle) {
+        size_t threshold = old_threshold > 4 * nursery_size ? old_threshold : 4 * nursery_size;
+        if (promoted >= threshold)
+            start_major(region);
+    } else if (region < cycle_region) {
+        // The evaluation that started the cycle is over
+        phase = idle;
+        major_grey.clear();
+    } else if (region == cycle_region) {
+        major_slice();
+    }
+}
+
+void GC::collect_minor(size_t region) {
+    minor = true;
+    mark_from = region > nursery_start ? region : nursery_start;
+    mark_to = next_seq;
+    for (RootSet &r : roots)
+        r.trace(r.owner, *this);
+    for (Managed *obj : remembered) {
+        obj->gc_remembered = false;
+        obj->trace(*this);
+    }
+    remembered.clear();
+    // The major cycle still has to scan these
+    for (Managed *obj : major_grey)
+        mark(obj);
+    while (!minor_grey.empty()) {
+        Managed *obj = minor_grey.back();
+        minor_grey.pop_back();
+        obj->trace(*this);
+    }
+    // Free the dead, promote the rest
+    Managed *obj = young;
+    while (obj != nullptr) {
+        Managed *next = obj->gc_next;
+        if (obj->gc_seq >= mark_from && !obj->gc_marked) {
+            free(obj);
+        } else {
+            obj->gc_marked = false;
+            obj->gc_next = old;
+            old = obj;
+            old_bytes += obj->gc_size;
+            promoted += obj->gc_size;
+        }
+        obj = next;
+    }
+    young = nullptr;
+    nursery_start = next_seq;
+    young_bytes = 0;
+    nminor++;
+}
+
+void GC::start_major(size_t region) {
+    phase = marking;
+    promoted = 0;
+    epoch++;
+    cycle_region = region;
+    snapshot = next_seq;
+    minor = false;
+    mark_from = cycle_region;
+    mark_to = snapshot;
+    // Only the roots are marked at once; the rest is traced in slices
+    for (RootSet &r : roots)
+        r.trace(r.owner, *this);
+}
+
+void GC::major_slice() {
+    size_t budget = pause_budget;
+    if (phase == marking) {
+        minor = false;
+        mark_from = cycle_region;
+        mark_to = snapshot;
+        for (; budget > 0 && !major_grey.empty(); budget--) {
+            Managed *obj = major_grey.back();
+            major_grey.pop_back();
+            obj->trace(*this);
+        }
+        if (major_grey.empty()) {
+            phase = sweeping;
+            sweep_link = &old;
+        }
+    }
+    if (phase == sweeping) {
+        // Promotions go in front of `old`, which is behind `sweep_link` or at it;
+        // either way they are made after the snapshot, or were marked
+        for (; budget > 0 && *sweep_link != nullptr; budget--) {
+            Managed *obj = *sweep_link;
+            if (obj->gc_seq >= cycle_region && obj->gc_seq < snapshot
+                && obj->gc_epoch != epoch && !obj->gc_remembered) {
+                *sweep_link = obj->gc_next;
+                old_bytes -= obj->gc_size;
+                free(obj);
+            } else {
+                sweep_link = &obj->gc_next;
+            }
+        }
+        if (*sweep_link == nullptr) {
+            // The old generation may double before the next cycle
+            phase = idle;
+            old_threshold = old_bytes;
+            nmajor++;
+        }
+    }
+}
+
+void GC::collect() {
+    // Everything is traced, so the cycle and the remembered set are moot
+    phase = idle;
+    major_grey.clear();
+    for (Managed *obj : remembered)
+        obj->gc_remembered = false;
+    remembered.clear();
+    epoch++;
+    minor = false;
+    mark_from = 0;
+    mark_to = next_seq;
+    for (RootSet &r : roots)
+        r.trace(r.owner, *this);
+    while (!major_grey.empty()) {
+        Managed *obj = major_grey.back();
+        major_grey.pop_back();
+        obj->trace(*this);
+    }
+    Managed *objs[] = {young, old};
+    old = nullptr;
+    old_bytes = 0;
+    for (Managed *obj : objs) {
+        while (obj != nullptr) {
+            Managed *next = obj->gc_next;
+            if (obj->gc_epoch != epoch) {
+                free(obj);
+            } else {
+                obj->gc_next = old;
+                old = obj;
+                old_bytes += obj->gc_size;
+            }
+            obj = next;
+        }
+    }
+    young = nullptr;
+    nursery_start = next_seq;
+    young_bytes = 0;
+    promoted = 0;
+    old_threshold = old_bytes;
+    nmajor++;
+}
+#endif
+
+TEST_CASE( "gc" ){
+    PTR(Expr) countdown = parse_str("_let f = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) _in f(f)(200000)");
+    GC &gc = GC::heap();
+#if ENABLE_GC
+    size_t minors = gc.minor_collections();
+    size_t majors = gc.major_collections();
+#endif
+    CHECK( Step::interp_by_steps(countdown).equals(Value::num(0)) );
+    CHECK( VM::interp_by_vm(countdown).equals(Value::num(0)) );
+#if ENABLE_GC
+    // Long runs collect the nursery as they go
+    CHECK( gc.minor_collections() > minors );
+#endif
+    
+    // A chain of closures that lives until the end goes to the old
+    // generation, which is marked and swept a little at each step
+    size_t nursery_size = gc.nursery_size;
+    size_t pause_budget = gc.pause_budget;
+    gc.nursery_size = 1 << 14;
+    gc.pause_budget = 16;
+    PTR(Expr) chain = parse_str("_let f = _fun (f) _fun (n)"
+                                "  _if n == 0 _then _fun (x) x"
+                                "  _else _let g = f(f)(n + -1) _in _fun (x) g(x + 1)"
+                                "_in f(f)(20000)(0)");
+    CHECK( Step::interp_by_steps(chain).equals(Value::num(20000)) );
+    gc.nursery_size = nursery_size;
+    gc.pause_budget = pause_budget;
+#if ENABLE_GC
+    CHECK( gc.major_collections() > majors );
+    
+    // A closure whose environment holds the closure itself
+    GC::Root<PTR(Expr)> keep(&countdown);
+    // Expression nodes are kept by their table
+    PTR(Expr) body = VarExpr::make(Symbol("f"));
+    gc.collect();
+    size_t live = gc.objects();
+    {
+        PTR(FlatEnv) env = NEW(FlatEnv)();
+        PTR(FuncVal) f = NEW(FuncVal)(Symbol("x"), body, env);
+        env->bind(Symbol("f"), Value::object(f));
+        CHECK( gc.objects() == live + 2 );
+    }
+    gc.collect();
+    CHECK( gc.objects() == live );
+    CHECK( Step::interp_by_steps(countdown).equals(Value::num(0)) );
+#endif
+}
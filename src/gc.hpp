@@ -0,0 +1,207 @@
+//
+//  gc.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/16/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef gc_hpp
+#define gc_hpp
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "pointer.hpp"
+
+class Value;
+class GC;
+
+#if ENABLE_GC
+/* Base of every object on the managed heap: the link that
+ threads each generation together, and the mark state.
+ `trace` reports the managed objects this one points to;
+ the destructor runs when it is swept. */
+class Managed {
+public:
+    Managed *gc_next;
+    size_t gc_seq;        // allocation number, older objects are smaller
+    unsigned gc_size;
+    unsigned gc_epoch;    // the last major cycle that marked it
+    bool gc_marked;       // by the minor collection in progress
+    bool gc_remembered;   // in the remembered set
+    
+    virtual ~Managed() {}
+    virtual void trace(GC &gc) = 0;
+};
+#endif
+
+/* Tracing garbage collector for ENABLE_GC. Objects are not
+ counted: pointers are plain pointers, and garbage, cycles
+ included, is found by marking what is reachable from the
+ roots and freeing the rest.
+ 
+ Roots are whatever is registered with `add_roots`: every
+ Step machine and running VM registers its registers, and
+ a host keeps its own pointers alive with a `Root`.
+ 
+ Collection only happens at a `safepoint`, which the
+ machines reach between steps and at calls, where nothing
+ lives only in C++ locals. It is generational: objects
+ start in the nursery, and once `nursery_size` bytes have
+ been allocated a minor collection frees the dead ones and
+ promotes the rest to the old generation. An object only
+ points to older ones unless it is changed after it is
+ made, which is rare (values are immutable) and must be
+ reported with `write_barrier`; so a minor collection
+ traces the roots and the remembered set, never the old
+ generation, and costs what survives, not the heap size.
+ 
+ When the old generation has doubled, a major cycle starts:
+ it marks from a snapshot of the roots and then sweeps, a
+ `pause_budget` of objects at each safepoint, so no pause
+ grows with the heap. Objects made during the cycle are
+ left for the next one. Since no reference to an old
+ object can be made except from one reachable at the
+ snapshot, nothing the program can still reach is missed.
+ 
+ Both only look at objects made since the evaluation that
+ reached the safepoint began, so a host's unregistered
+ pointers, which are all older, stay valid. `collect` is
+ the full, stop-the-world collection that a host calls
+ when it has registered everything it keeps.
+ 
+ In the other modes nothing is allocated here and all of
+ this is a no-op. */
+class GC {
+public:
+    typedef void (*trace_fn)(void *owner, GC &gc);
+    
+    static GC &heap();
+    
+    // Bytes allocated between minor collections
+    size_t nursery_size = 1 << 20;
+    // Objects marked or swept by a major cycle at each safepoint
+    size_t pause_budget = 1000;
+    
+#if ENABLE_GC
+    // Put an object in the nursery
+    void track(Managed *obj, size_t size);
+    void add_roots(void *owner, trace_fn trace);
+    void remove_roots(void *owner);
+    // The first allocation number of an evaluation starting now
+    size_t start_region() { return next_seq; }
+    // Collect what is due among the objects since `region`
+    void safepoint(size_t region) {
+        if (young_bytes >= nursery_size || phase != idle)
+            collect_some(region);
+    }
+    // `obj` was changed and may now point to newer objects
+    void write_barrier(Managed *obj) {
+        if (obj->gc_seq < nursery_start && !obj->gc_remembered) {
+            obj->gc_remembered = true;
+            remembered.push_back(obj);
+        }
+    }
+    void collect();
+    void mark(Managed *obj);
+#else
+    void add_roots(void *owner, trace_fn trace) {}
+    void remove_roots(void *owner) {}
+    size_t start_region() { return 0; }
+    void safepoint(size_t region) {}
+    template <class T> void write_barrier(const T &obj) {}
+    void collect() {}
+    template <class T> void mark(const T &obj) {}
+#endif
+    void mark(Value val);
+    
+    size_t objects() { return count; }
+    size_t minor_collections() { return nminor; }
+    size_t major_collections() { return nmajor; }
+    size_t freed() { return nfreed; }
+    
+    /* A host variable registered as a root for as long as
+     it is in scope. `P` is a `PTR(T)` or a `Value`. */
+    template <class P> class Root {
+    public:
+        P *slot;
+        
+        Root(P *slot) : slot(slot) {
+            GC::heap().add_roots(slot, [](void *p, GC &gc) { gc.mark(*static_cast<P*>(p)); });
+        }
+        ~Root() { GC::heap().remove_roots(slot); }
+        
+    private:
+        Root(const Root &) = delete;
+        Root &operator=(const Root &) = delete;
+    };
+    
+private:
+    struct RootSet {
+        void *owner;
+        trace_fn trace;
+    };
+    std::vector<RootSet> roots;
+    size_t count = 0;
+    size_t nminor = 0;
+    size_t nmajor = 0;
+    size_t nfreed = 0;
+#if ENABLE_GC
+    typedef enum {
+        idle,
+        marking,
+        sweeping
+    } phase_t;
+    
+    Managed *young = nullptr;
+    Managed *old = nullptr;
+    std::vector<Managed*> remembered;
+    size_t next_seq = 1;
+    size_t nursery_start = 1;
+    size_t young_bytes = 0;
+    size_t old_bytes = 0;
+    size_t promoted = 0;        // bytes since the last major cycle started
+    size_t old_threshold = 0;   // promoted bytes that start one, at least 4 nurseries
+    
+    // What `mark` marks: the objects numbered [mark_from, mark_to),
+    // for the minor collection or for the major cycle
+    bool minor;
+    size_t mark_from = 0;
+    size_t mark_to = 0;
+    std::vector<Managed*> minor_grey;
+    
+    // The major cycle, started in the evaluation at `cycle_region`
+    phase_t phase = idle;
+    unsigned epoch = 0;
+    size_t cycle_region = 0;
+    size_t snapshot = 0;
+    std::vector<Managed*> major_grey;
+    Managed **sweep_link = nullptr;
+    
+    void collect_some(size_t region);
+    void collect_minor(size_t region);
+    void start_major(size_t region);
+    void major_slice();
+    void free(Managed *obj);
+#endif
+};
+
+#if ENABLE_GC
+// Allocate a T on the managed heap, or on the plain heap if it is not `Managed`
+template <class T> T *gc_track(T *p, std::true_type) {
+    GC::heap().track(p, sizeof(T));
+    return p;
+}
+
+template <class T> T *gc_track(T *p, std::false_type) {
+    return p;
+}
+
+template <class T, class... Args> T *gc_new(Args&&... args) {
+    return gc_track(new T(std::forward<Args>(args)...), std::is_base_of<Managed, T>());
+}
+#endif
+
+#endif /* gc_hpp */
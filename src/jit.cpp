@@ -0,0 +1,496 @@
+//
+//  jit.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/18/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "jit.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "expr.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "gc.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+#if ENABLE_JIT
+#include <sys/mman.h>
+#endif
+
+bool Jit::enabled = false;
+int Jit::threshold = 100;
+
+static size_t ncompiled = 0;
+
+#if ENABLE_JIT
+/* What a compiled body returns: its value, or `bailed` set
+ if it recursed below the stack limit, having computed
+ nothing, since a call has no effects */
+struct NativeResult {
+    long value;
+    long bailed;
+};
+
+// Compiled body: the argument, the captured values in `JitEntry::captured` order, and the stack limit
+typedef NativeResult (*native_fn)(int arg, const int *captured, const char *limit);
+
+/* What the JIT knows about one function body. */
+struct JitEntry {
+    PTR(Expr) body;        // keeps the table's key alive
+    Symbol formal_arg;
+    Symbol self;           // the name the body calls itself by, if any
+    int calls;
+    bool failed;           // not compilable or too deep, always interpreted
+    native_fn code;        // null until compiled
+    Value::kind_t arg_kind;
+    Value::kind_t result_kind;
+    std::vector<Symbol> captured;
+    std::vector<Value::kind_t> captured_kinds;
+};
+
+static const size_t max_captured = 8;
+// Native stack a call may use before it bails to the interpreter
+static const size_t stack_budget = 256 * 1024;
+
+// Held while the table, or an entry in it, is read or written
+static std::mutex jit_mutex;
+
+static std::unordered_map<Expr*, JitEntry> &jit_table(){
+    // Never destroyed, like the code it points to
+    static std::unordered_map<Expr*, JitEntry> *table = nullptr;
+    if(table == nullptr){
+        table = new std::unordered_map<Expr*, JitEntry>();
+        GC::heap().add_roots(table, [](void *p, GC &gc) {
+            for(auto &it : *static_cast<std::unordered_map<Expr*, JitEntry>*>(p))
+                gc.mark(RAW(it.second.body));
+        });
+    }
+    return *table;
+}
+
+/* Single-pass compiler from a body to x86-64, System V ABI.
+ Each expression leaves its value in eax; the left operand
+ of a binary operation waits on the machine stack. The
+ argument and the `_let`s live in the native frame below
+ rbp, and captured values are read from the array in rsi.
+ Kinds are checked here, so the code itself cannot fail.
+ 
+ A named function's calls of itself by its name are native
+ calls of the code's start, with the same captured values,
+ since the function is the same closure. The value of such
+ a call is taken to be of `self_kind`, which the body must
+ then turn out to return. Each call checks rsp against the
+ limit in rdx first, and one that is below it returns with
+ rdx set, as does every caller after it, so the code
+ unwinds and the interpreter runs the call instead. */
+class JitCompiler {
+public:
+    JitCompiler(FuncVal *fun, JitEntry &entry, Value::kind_t self_kind)
+        : fun(fun), entry(entry), self_kind(self_kind), calls_self(false), nslots(0) {}
+    
+    // Fill in `entry.code`, or return false
+    bool compile(){
+        entry.captured.clear();
+        entry.captured_kinds.clear();
+        byte(0x55);                          // push rbp
+        bytes3(0x48, 0x89, 0xe5);            // mov rbp, rsp
+        bytes3(0x48, 0x81, 0xec);            // sub rsp, imm32
+        size_t frame_size = code.size();
+        dword(0);
+        bytes3(0x48, 0x39, 0xd4);            // cmp rsp, rdx
+        bytes2(0x0f, 0x82);                  // jb rel32, to bail
+        dword(0);
+        bails.push_back(code.size());
+        limit_slot = nslots++;
+        bytes3(0x48, 0x89, 0x95);            // mov [rbp + disp32], rdx
+        dword(disp(limit_slot));
+        bind(entry.formal_arg, entry.arg_kind);
+        bytes2(0x89, 0xbd);                  // mov [rbp + disp32], edi
+        dword(disp(slots.back()));
+        if(!expr(RAW(entry.body), entry.result_kind))
+            return false;
+        if(calls_self && entry.result_kind != self_kind)
+            return false;
+        bytes2(0x31, 0xd2);                  // xor edx, edx
+        byte(0xc9);                          // leave
+        byte(0xc3);                          // ret
+        for(size_t after_jump : bails)
+            patch(after_jump);
+        byte(0xba);                          // mov edx, 1
+        dword(1);
+        byte(0xc9);                          // leave
+        byte(0xc3);                          // ret
+        int size = (nslots * 8 + 15) & ~15;
+        std::memcpy(&code[frame_size], &size, 4);
+        return install();
+    }
+    
+private:
+    FuncVal *fun;
+    JitEntry &entry;
+    Value::kind_t self_kind;
+    bool calls_self;
+    int limit_slot;
+    // Jumps to the code that bails out, to patch once it is there
+    std::vector<size_t> bails;
+    std::vector<unsigned char> code;
+    // Variables in the native frame, innermost last
+    std::vector<Symbol> names;
+    std::vector<int> slots;
+    std::vector<Value::kind_t> kinds;
+    int nslots;
+    
+    void byte(int b) { code.push_back((unsigned char)b); }
+    void bytes2(int a, int b) { byte(a); byte(b); }
+    void bytes3(int a, int b, int c) { byte(a); byte(b); byte(c); }
+    void dword(int d) {
+        unsigned char buf[4];
+        std::memcpy(buf, &d, 4);
+        code.insert(code.end(), buf, buf + 4);
+    }
+    int disp(int slot) { return -8 * (slot + 1); }
+    
+    void bind(Symbol name, Value::kind_t kind){
+        names.push_back(name);
+        slots.push_back(nslots++);
+        kinds.push_back(kind);
+    }
+    void unbind(){
+        names.pop_back();
+        slots.pop_back();
+        kinds.pop_back();
+    }
+    
+    // Emit a jump with a rel32 to fill in by `patch`
+    size_t jump(bool if_zero){
+        if(if_zero)
+            bytes2(0x0f, 0x84);              // jz rel32
+        else
+            byte(0xe9);                      // jmp rel32
+        dword(0);
+        return code.size();
+    }
+    void patch(size_t after_jump){
+        int rel = (int)(code.size() - after_jump);
+        std::memcpy(&code[after_jump - 4], &rel, 4);
+    }
+    
+    // Whether `name` is the argument or a `_let` in scope
+    bool bound(Symbol name){
+        return std::find(names.begin(), names.end(), name) != names.end();
+    }
+    
+    bool var(Symbol name, Value::kind_t &kind){
+        for(size_t i = names.size(); i-- > 0; ){
+            if(names[i] == name){
+                bytes2(0x8b, 0x85);          // mov eax, [rbp + disp32]
+                dword(disp(slots[i]));
+                kind = kinds[i];
+                return true;
+            }
+        }
+        // The function itself is not a number or a boolean
+        if(name == entry.self)
+            return false;
+        size_t index = 0;
+        while(index < entry.captured.size() && entry.captured[index] != name)
+            index++;
+        if(index == entry.captured.size()){
+            Value val;
+            if(!fun->env->find(name, val) || val.kind == Value::obj_kind || index == max_captured)
+                return false;
+            entry.captured.push_back(name);
+            entry.captured_kinds.push_back(val.kind);
+        }
+        bytes2(0x8b, 0x86);                  // mov eax, [rsi + disp32]
+        dword((int)(4 * index));
+        kind = entry.captured_kinds[index];
+        return true;
+    }
+    
+    // Left operand on the stack, right in ecx
+    bool operands(Expr *lhs, Expr *rhs, Value::kind_t &lhs_kind, Value::kind_t &rhs_kind){
+        if(!expr(lhs, lhs_kind))
+            return false;
+        byte(0x50);                          // push rax
+        if(!expr(rhs, rhs_kind))
+            return false;
+        bytes2(0x89, 0xc1);                  // mov ecx, eax
+        byte(0x58);                          // pop rax
+        return true;
+    }
+    
+    bool expr(Expr *e, Value::kind_t &kind){
+        Value::kind_t lhs_kind, rhs_kind;
+        switch(e->kind){
+            case Expr::num_expr:
+                byte(0xb8);                  // mov eax, imm32
+                dword(static_cast<NumExpr*>(e)->val);
+                kind = Value::num_kind;
+                return true;
+            case Expr::bool_expr:
+                byte(0xb8);
+                dword(static_cast<BoolExpr*>(e)->val);
+                kind = Value::bool_kind;
+                return true;
+            case Expr::var_expr:
+                return var(static_cast<VarExpr*>(e)->name, kind);
+            case Expr::add_expr: {
+                AddExpr *a = static_cast<AddExpr*>(e);
+                if(!operands(RAW(a->lhs), RAW(a->rhs), lhs_kind, rhs_kind)
+                   || lhs_kind != Value::num_kind || rhs_kind != Value::num_kind)
+                    return false;
+                bytes2(0x01, 0xc8);          // add eax, ecx
+                kind = Value::num_kind;
+                return true;
+            }
+            case Expr::mult_expr: {
+                MultExpr *m = static_cast<MultExpr*>(e);
+                if(!operands(RAW(m->lhs), RAW(m->rhs), lhs_kind, rhs_kind)
+                   || lhs_kind != Value::num_kind || rhs_kind != Value::num_kind)
+                    return false;
+                bytes3(0x0f, 0xaf, 0xc1);    // imul eax, ecx
+                kind = Value::num_kind;
+                return true;
+            }
+            case Expr::equ_expr: {
+                EquExpr *q = static_cast<EquExpr*>(e);
+                if(!operands(RAW(q->lhs), RAW(q->rhs), lhs_kind, rhs_kind))
+                    return false;
+                if(lhs_kind != rhs_kind){
+                    // A number never equals a boolean
+                    byte(0xb8);
+                    dword(0);
+                }else{
+                    bytes2(0x39, 0xc8);      // cmp eax, ecx
+                    bytes3(0x0f, 0x94, 0xc0);// sete al
+                    bytes3(0x0f, 0xb6, 0xc0);// movzx eax, al
+                }
+                kind = Value::bool_kind;
+                return true;
+            }
+            case Expr::if_expr: {
+                IfExpr *i = static_cast<IfExpr*>(e);
+                Value::kind_t test_kind, then_kind, else_kind;
+                if(!expr(RAW(i->test_part), test_kind) || test_kind != Value::bool_kind)
+                    return false;
+                bytes2(0x85, 0xc0);          // test eax, eax
+                size_t to_else = jump(true);
+                if(!expr(RAW(i->then_part), then_kind))
+                    return false;
+                size_t to_end = jump(false);
+                patch(to_else);
+                if(!expr(RAW(i->else_part), else_kind) || else_kind != then_kind)
+                    return false;
+                patch(to_end);
+                kind = then_kind;
+                return true;
+            }
+            case Expr::let_expr: {
+                LetExpr *l = static_cast<LetExpr*>(e);
+                Value::kind_t rhs_kind;
+                if(!expr(RAW(l->rhs), rhs_kind))
+                    return false;
+                bind(l->let_var, rhs_kind);
+                bytes2(0x89, 0x85);          // mov [rbp + disp32], eax
+                dword(disp(slots.back()));
+                bool ok = expr(RAW(l->body), kind);
+                unbind();
+                return ok;
+            }
+            case Expr::call_expr: {
+                CallExpr *c = static_cast<CallExpr*>(e);
+                Value::kind_t arg_kind;
+                // Only a call of the function itself, by its name
+                if(entry.self == Symbol() || c->to_be_called->kind != Expr::var_expr
+                   || static_cast<VarExpr*>(RAW(c->to_be_called))->name != entry.self || bound(entry.self))
+                    return false;
+                if(!expr(RAW(c->actual_arg), arg_kind) || arg_kind != entry.arg_kind)
+                    return false;
+                bytes2(0x89, 0xc7);          // mov edi, eax
+                bytes3(0x48, 0x8b, 0x95);    // mov rdx, [rbp + disp32]
+                dword(disp(limit_slot));
+                byte(0xe8);                  // call rel32, to the start
+                dword(-(int)(code.size() + 4));
+                bytes3(0x48, 0x85, 0xd2);    // test rdx, rdx
+                bytes2(0x0f, 0x85);          // jnz rel32, to bail
+                dword(0);
+                bails.push_back(code.size());
+                calls_self = true;
+                kind = self_kind;
+                return true;
+            }
+            default:
+                // Functions and other calls stay in the interpreter
+                return false;
+        }
+    }
+    
+    bool install(){
+        size_t size = code.size();
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if(mem == MAP_FAILED)
+            return false;
+        std::memcpy(mem, code.data(), size);
+        if(mprotect(mem, size, PROT_READ | PROT_EXEC) != 0){
+            munmap(mem, size);
+            return false;
+        }
+        entry.code = reinterpret_cast<native_fn>(mem);
+        return true;
+    }
+};
+#endif
+
+bool Jit::call(FuncVal *fun, Value arg, Value &result){
+#if ENABLE_JIT
+    JitEntry *entry;
+    {
+        std::lock_guard<std::mutex> lock(jit_mutex);
+        auto it = jit_table().find(RAW(fun->body));
+        if(it == jit_table().end()){
+            JitEntry e = {fun->body, fun->formal_arg, fun->self, 0, false, nullptr,
+                          Value::num_kind, Value::num_kind, std::vector<Symbol>(), std::vector<Value::kind_t>()};
+            it = jit_table().insert(std::make_pair(RAW(fun->body), e)).first;
+        }
+        entry = &it->second;
+        if(entry->failed || fun->formal_arg != entry->formal_arg || fun->self != entry->self)
+            return false;
+        if(entry->code == nullptr){
+            if(++entry->calls < threshold)
+                return false;
+            if(arg.kind == Value::obj_kind){
+                // Ask again at the next call
+                entry->calls--;
+                return false;
+            }
+            entry->arg_kind = arg.kind;
+            // A body that calls itself is tried with each kind its calls could return
+            JitCompiler as_num(fun, *entry, Value::num_kind);
+            if(!as_num.compile()){
+                JitCompiler as_bool(fun, *entry, Value::bool_kind);
+                if(!as_bool.compile()){
+                    entry->failed = true;
+                    return false;
+                }
+            }
+            ncompiled++;
+        }
+    }
+    // Once compiled, an entry only changes to fail
+    if(arg.kind != entry->arg_kind)
+        return false;
+    int captured[max_captured];
+    for(size_t i = 0; i < entry->captured.size(); i++){
+        Value val;
+        if(!fun->env->find(entry->captured[i], val) || val.kind != entry->captured_kinds[i])
+            return false;
+        captured[i] = val.rep;
+    }
+    char here;
+    const char *limit = reinterpret_cast<const char*>(reinterpret_cast<uintptr_t>(&here) - stack_budget);
+    NativeResult native = entry->code(arg.rep, captured, limit);
+    if(native.bailed){
+        // Interpreted from now on, or each level of the recursion would try again
+        std::lock_guard<std::mutex> lock(jit_mutex);
+        entry->failed = true;
+        return false;
+    }
+    int rep = (int)native.value;
+    result = entry->result_kind == Value::num_kind ? Value::num(rep) : Value::boolean(rep);
+    return true;
+#else
+    return false;
+#endif
+}
+
+size_t Jit::compiled(){
+    return ncompiled;
+}
+
+#if ENABLE_JIT
+TEST_CASE( "jit" ){
+    bool enabled = Jit::enabled;
+    int threshold = Jit::threshold;
+    Jit::enabled = true;
+    Jit::threshold = 2;
+    size_t compiled = Jit::compiled();
+
+    // Same answers as the interpreters, once compiled
+    PTR(Expr) poly = parse_str("_let k = 3 _in _let f = _fun (x) _let y = x * x _in _if y == 4 _then k _else y + k * x + -1"
+                               "_in f(1) + f(2) + f(3) + f(4)");
+    CHECK( Expr::interp_by_tree(poly).equals(Value::num(50)) );
+    CHECK( Jit::compiled() == compiled + 1 );
+    CHECK( Expr::interp_by_tree(poly).equals(Value::num(50)) );
+    CHECK( Step::interp_by_steps(poly).equals(Value::num(50)) );
+    // A captured number, different in each closure
+    CHECK( Expr::interp_by_tree(parse_str("_let f = _fun (x) _fun (y) x + y _in f(1)(2) + f(3)(4) + f(5)(6)")).equals(Value::num(21)) );
+    CHECK( Jit::compiled() == compiled + 2 );
+
+    // Booleans in and out, and `==` across kinds
+    CHECK( Expr::interp_by_tree(parse_str("_let not = _fun (b) _if b _then _false _else b == 1"
+                                          "_in _if not(_true) _then 1 _else _if not(_false) _then 2 _else 3")).equals(Value::num(3)) );
+
+    // An argument of another kind is interpreted, errors included
+    CHECK( Expr::interp_by_tree(parse_str("_let f = _fun (x) x == 2 _in _if f(1) _then 0 _else _if f(2) _then f(_true) _else 0"))
+          .equals(Value::boolean(false)) );
+    CHECK_THROWS_WITH( Expr::interp_by_tree(parse_str("_let f = _fun (x) x + 1 _in f(1) + f(2) + f(_true)")), "No adding booleans" );
+
+    // Bodies with calls, closures or a possible error are never compiled
+    compiled = Jit::compiled();
+    CHECK( Expr::interp_by_tree(parse_str("_let id = _fun (x) x _in _let g = _fun (f) f(1) _in g(id) + g(id) + g(id)")).equals(Value::num(3)) );
+    CHECK( Jit::compiled() == compiled + 1 );
+    CHECK( Expr::interp_by_tree(parse_str("_let f = _fun (x) _if x == 0 _then 1 _else x + _true _in f(0) + f(0) + f(0)")).equals(Value::num(3)) );
+    CHECK( Expr::interp_by_tree(parse_str("_let f = _fun (x) _fun (y) y _in f(0)(1) + f(0)(1) + f(0)(1)")).equals(Value::num(3)) );
+    CHECK( Jit::compiled() == compiled + 2 );
+
+    // A named function's calls of itself are native calls, however it was named
+    compiled = Jit::compiled();
+    CHECK( Expr::interp_by_tree(parse_str("_letrec fib = _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1"
+                                          "                       _else fib(n + -1) + fib(n + -2)"
+                                          "_in fib(20)")).equals(Value::num(6765)) );
+    CHECK( Jit::compiled() == compiled + 1 );
+    // The same body made directly recursive by lowering runs the same code
+    CHECK( Step::interp_by_steps(parse_str("_let fib = _fun (fib) _fun (n) _if n == 0 _then 0 _else _if n == 1 _then 1"
+                                           "                              _else fib(fib)(n + -1) + fib(fib)(n + -2)"
+                                           "_in fib(fib)(20)")).equals(Value::num(6765)) );
+    CHECK( Jit::compiled() == compiled + 1 );
+    // One returning a boolean, and one whose name is shadowed, which is a leaf
+    CHECK( Expr::interp_by_tree(parse_str("_letrec even = _fun (n) _if n == 0 _then _true _else _if n == 1 _then _false _else even(n + -2)"
+                                          "_in _if even(30) _then even(41) _else _true")).equals(Value::boolean(false)) );
+    CHECK( Expr::interp_by_tree(parse_str("_letrec f = _fun (x) _let f = x + 1 _in f * 2 _in f(1) + f(2) + f(3)")).equals(Value::num(18)) );
+    CHECK( Jit::compiled() == compiled + 3 );
+    // Too deep for the native stack: the code unwinds and the call is interpreted
+    CHECK( Step::interp_by_steps(parse_str("_letrec down = _fun (n) _if n == 0 _then 7 _else down(n + -1) _in down(1000000)"))
+          .equals(Value::num(7)) );
+    CHECK( Jit::compiled() == compiled + 4 );
+
+#if !ENABLE_REFCOUNT && !ENABLE_GC
+    // Machines on other threads share the compiled code; those two modes are single-threaded (see Expr::hash)
+    PTR(Expr) tri = parse_str("_letrec tri = _fun (n) _if n == 0 _then 0 _else n + tri(n + -1) _in tri(300)");
+    std::atomic<int> right(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 4; i++)
+        threads.emplace_back([&]() {
+            for(int j = 0; j < 10; j++)
+                if(Step::interp_by_steps(tri).equals(Value::num(45150)))
+                    right++;
+        });
+    for(std::thread &t : threads)
+        t.join();
+    CHECK( right == 4 * 10 );
+    CHECK( Jit::compiled() == compiled + 5 );
+#endif
+
+    Jit::enabled = enabled;
+    Jit::threshold = threshold;
+}
+#endif
@@ -0,0 +1,63 @@
+//
+//  jit.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/18/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef jit_hpp
+#define jit_hpp
+
+#include <cstddef>
+#include "pointer.hpp"
+#include "value.hpp"
+
+// 1: compile hot function bodies to x86-64 (where the platform allows it), 0: never.
+// Not with ENABLE_ARENA, where a body can be freed with its arena while still in the table.
+#ifndef ENABLE_JIT
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !ENABLE_ARENA
+#define ENABLE_JIT 1
+#else
+#define ENABLE_JIT 0
+#endif
+#endif
+
+class FuncVal;
+
+/* Baseline compiler from function bodies to native code,
+ used by the tree and step interpreters when `enabled`.
+
+ Every call of a FuncVal is counted by body; the call that
+ reaches `threshold` compiles the body for the kinds of
+ the argument and captured variables it was called with.
+ Numbers and booleans then live unboxed in registers and
+ the native frame, and arithmetic, `==` and `_if` are
+ machine instructions. A named function's calls of itself
+ are native calls, so a recursion like fib runs natively
+ from its first compiled call down. A body using anything
+ else (a function, another call, a variable that is not a
+ number or a boolean) or one that could fail is not
+ compiled, and is always interpreted. A compiled body
+ checks the kinds on entry; a call that does not fit is
+ interpreted, and so is one that recurses too deep for the
+ native stack, along with every later call of the body.
+
+ Compiled code is kept for the life of the process, and
+ shared by every thread; a lock guards the table of it. */
+class Jit {
+public:
+    static bool enabled;
+    // Calls of a body before it is compiled
+    static int threshold;
+    
+    /* Run `fun` natively if its body is compiled and fits
+     the argument, putting the result in `result`. Returns
+     false if `fun` must be interpreted. */
+    static bool call(FuncVal *fun, Value arg, Value &result);
+    
+    // Bodies compiled so far
+    static size_t compiled();
+};
+
+#endif /* jit_hpp */
@@ -6,21 +6,51 @@
 //  Copyright © 2020 Xuefeng Xu. All rights reserved.
 //
 
+#include <cstdlib>
 #include <iostream>
 #include "parse.hpp"
 #include "env.hpp"
 #include "expr.hpp"
 #include "step.hpp"
 #include "value.hpp"
+#include "vm.hpp"
+#include "jit.hpp"
+#include "memo.hpp"
+#include "aot.hpp"
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
 
 int main(int argc, char **argv){
     std::cout << "MSDScript is running ... " << std::endl;
+    // JIT and memo options come first and apply to any mode
+    while(argc > 1){
+        std::string arg = argv[1];
+        int used = 0;
+        if(arg == "--jit"){
+            Jit::enabled = true;
+            used = 1;
+        }else if(arg == "--jit-threshold" && argc > 2){
+            Jit::enabled = true;
+            Jit::threshold = std::atoi(argv[2]);
+            used = 2;
+        }else if(arg == "--memo"){
+            Memo::enabled = true;
+            used = 1;
+        }else if(arg == "--memo-capacity" && argc > 2){
+            Memo::enabled = true;
+            Memo::capacity = std::atoi(argv[2]);
+            used = 2;
+        }else{
+            break;
+        }
+        argv[used] = argv[0];
+        argv += used;
+        argc -= used;
+    }
     if(argc <= 1){
         std::cout << "MSDscript Interpreter is running...\nEnter an expression: " << std::endl;
         PTR(Expr) e = parse(std::cin);
-        std::cout << e->interp(Env::emptyenv)->to_string() << std::endl;
+        std::cout << Expr::interp_by_tree(e).to_string() << std::endl;
     }else{
         std::string arg = argv[1];
         if(arg == "--opt"){
@@ -29,17 +59,42 @@ int main(int argc, char **argv){
                     std::cout << e->optimize()->to_string() << "\n";
         } else if (arg == "--step") {
             std::cout << "MSDscript Interpreter is running with steps...\nEnter an expression: " << std::endl;
-            std::cout << Step::interp_by_steps(parse(std::cin))->to_string() << std::endl;
+            std::cout << Step::interp_by_steps(parse(std::cin)).to_string() << std::endl;
         } else if (arg == "--script"){
             std::ifstream file;
             file.open(argv[2], std::ios::in);
             std::cout << "MSDscript Interpreter is running with steps..." << std::endl;
-            std::cout << Step::interp_by_steps(parse(file))->to_string() << std::endl;
+            std::cout << Step::interp_by_steps(parse(file)).to_string() << std::endl;
+            file.close();
+        } else if (arg == "--vm") {
+            if (argc > 2) {
+                std::ifstream file;
+                file.open(argv[2], std::ios::in);
+                std::cout << "MSDscript Interpreter is running with bytecode..." << std::endl;
+                std::cout << VM::interp_by_vm(parse(file)).to_string() << std::endl;
+                file.close();
+            } else {
+                std::cout << "MSDscript Interpreter is running with bytecode...\nEnter an expression: " << std::endl;
+                std::cout << VM::interp_by_vm(parse(std::cin)).to_string() << std::endl;
+            }
+#if ENABLE_VM_PROFILE
+            VM::print_profile(std::cerr, 20);
+#endif
+        } else if (arg == "--compile" && argc > 4 && (std::string)argv[3] == "-o") {
+            std::ifstream file;
+            file.open(argv[2], std::ios::in);
+            std::cout << "MSDscript Compiler is running..." << std::endl;
+            Aot::compile(parse(file), argv[4]);
             file.close();
+        } else if (arg == "--run" && argc > 2) {
+            std::cout << "MSDscript Interpreter is running natively..." << std::endl;
+            std::cout << Aot::run(argv[2]).to_string() << std::endl;
         } else {
-            std::cout << "Usage: ./msdscript for interpreter\n./msdscript --opt for optimizer" << std::endl;
+            std::cout << "Usage: ./msdscript for interpreter\n./msdscript --opt for optimizer\n./msdscript --vm [script.msd] for bytecode interpreter\n./msdscript --compile script.msd -o script.so for a native module\n./msdscript --run script.so to run one\n--jit or --jit-threshold N before any of them to compile hot functions\n--memo or --memo-capacity N before any of them to memoize calls" << std::endl;
             return 2;
         }
     }
+    if(Memo::enabled)
+        std::cerr << "memo: " << Memo::total_hits << " hits, " << Memo::total_misses << " misses" << std::endl;
     return 0;
 }
@@ -0,0 +1,186 @@
+//
+//  memo.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/20/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "memo.hpp"
+#include <functional>
+#include "expr.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "gc.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+bool Memo::enabled = false;
+size_t Memo::capacity = 10000;
+thread_local Memo *Memo::current = nullptr;
+size_t Memo::total_hits = 0;
+size_t Memo::total_misses = 0;
+
+// Numbers and booleans by value, functions by identity
+static bool same(const Value &a, const Value &b){
+    if(a.kind != b.kind)
+        return false;
+    if(a.kind != Value::obj_kind)
+        return a.rep == b.rep;
+    return RAW(a.obj) == RAW(b.obj);
+}
+
+static size_t hash_value(const Value &val){
+    if(val.kind != Value::obj_kind)
+        return (size_t)val.kind * 31 + (size_t)(unsigned)val.rep;
+    return std::hash<void*>()(RAW(val.obj));
+}
+
+Memo::Key::Key(PTR(Expr) fun, PTR(Env) env, Value arg) : fun(fun), env(nullptr), arg(arg) {
+    hash = std::hash<void*>()(RAW(fun)) * 31 + hash_value(arg);
+    PTR(FlatEnv) flat = CAST(FlatEnv)(env);
+    if(flat != nullptr){
+        for(int i = 0; i < flat->size; i++){
+            captured.push_back(flat->binding(i));
+            hash = (hash * 31 + (size_t)flat->binding(i).name.id) * 31 + hash_value(flat->binding(i).val);
+        }
+    }else{
+        this->env = env;
+        hash = hash * 31 + std::hash<void*>()(RAW(env));
+    }
+}
+
+bool Memo::Key::operator==(const Key &other) const {
+    if(hash != other.hash || RAW(fun) != RAW(other.fun) || RAW(env) != RAW(other.env)
+       || !same(arg, other.arg) || captured.size() != other.captured.size())
+        return false;
+    for(size_t i = 0; i < captured.size(); i++)
+        if(captured[i].name != other.captured[i].name || !same(captured[i].val, other.captured[i].val))
+            return false;
+    return true;
+}
+
+Memo::Memo() : hits(0), misses(0), evictions(0) {
+    GC::heap().add_roots(this, [](void *p, GC &gc) { static_cast<Memo*>(p)->trace(gc); });
+}
+
+Memo::~Memo() {
+    GC::heap().remove_roots(this);
+}
+
+bool Memo::find(const Key &key, Value &result){
+    auto found = index.find(&key);
+    if(found == index.end()){
+        misses++;
+        total_misses++;
+        return false;
+    }
+    hits++;
+    total_hits++;
+    entries.splice(entries.begin(), entries, found->second);
+    result = found->second->result;
+    return true;
+}
+
+void Memo::store(const Key &key, Value result){
+    if(capacity == 0)
+        return;
+    auto found = index.find(&key);
+    if(found != index.end()){
+        // Recorded by a call inside this one
+        entries.splice(entries.begin(), entries, found->second);
+        return;
+    }
+    if(entries.size() >= capacity){
+        index.erase(&entries.back().key);
+        entries.pop_back();
+        evictions++;
+    }
+    Entry entry = {key, result};
+    entries.push_front(entry);
+    index[&entries.front().key] = entries.begin();
+}
+
+size_t Memo::size(){
+    return entries.size();
+}
+
+void Memo::clear(){
+    index.clear();
+    entries.clear();
+}
+
+void Memo::trace(GC &gc){
+    for(Entry &entry : entries){
+        gc.mark(RAW(entry.key.fun));
+        gc.mark(RAW(entry.key.env));
+        for(FlatEnv::Binding &binding : entry.key.captured)
+            gc.mark(binding.val);
+        gc.mark(entry.key.arg);
+        gc.mark(entry.result);
+    }
+}
+
+TEST_CASE( "memo" ){
+    bool enabled = Memo::enabled;
+    size_t capacity = Memo::capacity;
+    Memo::enabled = true;
+
+    // Each fib(fib)(n) runs once, however often it is asked for
+    PTR(Expr) fib = parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 2 + -1 _then 1"
+                              "                   _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                              "_in fib(fib)(40)");
+    size_t hits = Memo::total_hits, misses = Memo::total_misses;
+    CHECK( Expr::interp_by_tree(fib).equals(Value::num(165580141)) );
+    CHECK( Memo::total_misses - misses < 100 );
+    CHECK( Memo::total_hits - hits > 0 );
+    hits = Memo::total_hits;
+    misses = Memo::total_misses;
+    CHECK( Step::interp_by_steps(fib).equals(Value::num(165580141)) );
+    CHECK( Memo::total_misses - misses < 100 );
+    CHECK( Memo::total_hits - hits > 0 );
+
+    // Closures of one body over different values are different functions
+    PTR(Expr) adders = parse_str("_let add = _fun (x) _fun (y) x + y _in add(1)(10) + add(2)(10) + add(1)(10)");
+    CHECK( Expr::interp_by_tree(adders).equals(Value::num(34)) );
+    CHECK( Step::interp_by_steps(adders).equals(Value::num(34)) );
+    // A function argument is kept by identity, not compared with `equals`
+    PTR(Expr) apply = parse_str("_let apply = _fun (f) f(1) _in apply(_fun (x) x + 1) + apply(_fun (x) x + 2)");
+    CHECK( Expr::interp_by_tree(apply).equals(Value::num(5)) );
+    CHECK( Step::interp_by_steps(apply).equals(Value::num(5)) );
+    // Functions of one body are told apart by their argument, name and captured names
+    PTR(Expr) named = parse_str("_let b = _fun (f) f _in _letrec f = _fun (x) f _in b(1) + f(1)");
+    CHECK_THROWS_WITH( Expr::interp_by_tree(named), "Addend is not a number" );
+    CHECK_THROWS_WITH( Step::interp_by_steps(named), "Addend is not a number" );
+    PTR(Expr) captured = parse_str("_let fa = (_let a = 5 _in _fun (x) _if x == 0 _then a _else b)"
+                                   "_in _let fb = (_let b = 5 _in _fun (x) _if x == 0 _then a _else b)"
+                                   "_in fa(0) + fb(0)");
+    CHECK_THROWS_WITH( Expr::interp_by_tree(captured), "free variablea" );
+    CHECK_THROWS_WITH( Step::interp_by_steps(captured), "free variablea" );
+    // Failing calls are not recorded
+    CHECK_THROWS_WITH( Expr::interp_by_tree(parse_str("_let f = _fun (x) x + 1 _in f(1) + f(_true)")), "No adding booleans" );
+
+    // The least recently used result goes first
+    Step step;
+    Memo::capacity = 2;
+    CHECK( step.run(parse_str("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 2 + -1 _then 1"
+                              "                   _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                              "_in fib(fib)(15)")).equals(Value::num(987)) );
+    CHECK( step.memo.size() == 2 );
+    CHECK( step.memo.evictions > 0 );
+    PTR(Expr) fun = FuncExpr::make("x", VarExpr::make("x"));
+    Memo memo;
+    memo.store(Memo::Key(fun, Env::emptyenv, Value::num(1)), Value::num(1));
+    memo.store(Memo::Key(fun, Env::emptyenv, Value::num(2)), Value::num(2));
+    Value result;
+    CHECK( memo.find(Memo::Key(fun, Env::emptyenv, Value::num(1)), result) );
+    memo.store(Memo::Key(fun, Env::emptyenv, Value::num(3)), Value::num(3));
+    CHECK( !memo.find(Memo::Key(fun, Env::emptyenv, Value::num(2)), result) );
+    CHECK( memo.find(Memo::Key(fun, Env::emptyenv, Value::num(1)), result) );
+    CHECK( result.equals(Value::num(1)) );
+    CHECK( memo.hits == 2 );
+    CHECK( memo.misses == 1 );
+
+    Memo::enabled = enabled;
+    Memo::capacity = capacity;
+}
@@ -0,0 +1,111 @@
+//
+//  memo.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/20/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef memo_hpp
+#define memo_hpp
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "pointer.hpp"
+#include "value.hpp"
+#include "env.hpp"
+
+class Expr;
+class GC;
+
+/* Table of function results for one interpreter, used when
+ `enabled`. A call has no effects, so a FuncVal called with
+ the same argument always gives the same value; a hit
+ returns it without running the body.
+
+ A call is keyed by the function's FuncExpr node, which
+ holds its argument name, body and name if any, the values
+ it captured with their names, and the argument. Functions
+ among the values are
+ compared by identity, not with `equals`, since two closures
+ of one body can capture different values; the table keeps
+ what it keys on alive, so an address is never reused for
+ another function while its entries remain. The table
+ holds at most `capacity` results and forgets the least
+ recently used first.
+
+ The tree interpreter uses `current`, which
+ `Expr::interp_by_tree` sets for the run; each Step machine
+ has its own `memo`. A call that fails is not recorded. */
+class Memo {
+public:
+    static bool enabled;
+    // Results kept by each table
+    static size_t capacity;
+    // Table of the running tree interpretation, if memoizing
+    static thread_local Memo *current;
+    // Over all tables so far
+    static size_t total_hits;
+    static size_t total_misses;
+
+    /* A call of `fun`, a FuncExpr, from a closure over `env`
+     with `arg`. The bindings of a FlatEnv are compared one
+     by one, name and value; any other environment by
+     identity. */
+    struct Key {
+        PTR(Expr) fun;
+        PTR(Env) env;                             // null for a FlatEnv
+        std::vector<FlatEnv::Binding> captured;   // the bindings of a FlatEnv
+        Value arg;
+        size_t hash;
+
+        Key(PTR(Expr) fun, PTR(Env) env, Value arg);
+        bool operator==(const Key &other) const;
+    };
+
+    // Makes `memo` current until the end of the scope
+    class Use {
+    public:
+        Use(Memo *memo) : saved(current) { current = memo; }
+        ~Use() { current = saved; }
+    private:
+        Memo *saved;
+    };
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    Memo();
+    ~Memo();
+    // The result recorded for `key`, which becomes the most recently used
+    bool find(const Key &key, Value &result);
+    // Record a result, forgetting the least recently used one if full
+    void store(const Key &key, Value result);
+    size_t size();
+    void clear();
+    // Mark the keys and results
+    void trace(GC &gc);
+
+private:
+    struct Entry {
+        Key key;
+        Value result;
+    };
+    struct KeyHash {
+        size_t operator()(const Key *key) const { return key->hash; }
+    };
+    struct KeyEquals {
+        bool operator()(const Key *a, const Key *b) const { return *a == *b; }
+    };
+    // Most recently used first; `index` points into it
+    std::list<Entry> entries;
+    std::unordered_map<const Key*, std::list<Entry>::iterator, KeyHash, KeyEquals> index;
+
+    Memo(const Memo &) = delete;
+    Memo &operator=(const Memo &) = delete;
+};
+
+#endif /* memo_hpp */
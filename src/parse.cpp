@@ -40,7 +40,7 @@ PTR(Expr) parse_multicand(std::istream &in);
 PTR(Expr) parse_inner(std::istream &in);
 PTR(Expr) parse_number(std::istream &in);
 PTR(Expr) parse_variable(std::istream &in);
-PTR(Expr) parse_let(std::istream &in);
+PTR(Expr) parse_let(std::istream &in, bool recursive);
 PTR(Expr) parse_fun(std::istream &in);
 std::string parse_keyword(std::istream &in);
 std::string parse_alphabetic(std::istream &in, std::string prefix);
@@ -59,7 +59,7 @@ PTR(Expr) parse_expr(std::istream &in) {
         if(get_next(in) != '=') throw std::runtime_error((std::string)"should be double equal");
         PTR(Expr) temp = parse_expr(in);
         if(temp == nullptr) return nullptr;
-        return NEW(EquExpr)(num, temp);
+        return EquExpr::make(num, temp);
     }
     return num;
 }
@@ -76,7 +76,7 @@ PTR(Expr) parse_comparg(std::istream &in){
         get_next(in);
         PTR(Expr) comp = parse_comparg(in);
         if(comp == nullptr) return nullptr;
-        return NEW(AddExpr)(add, comp);
+        return AddExpr::make(add, comp);
     }
     return add;
 }
@@ -94,7 +94,7 @@ PTR(Expr) parse_addend(std::istream &in) {
         get_next(in);
         PTR(Expr) temp = parse_addend(in);
         if(temp == nullptr) return nullptr;
-        return NEW(MultExpr)(num, temp);
+        return MultExpr::make(num, temp);
     }
     return num;
 }
@@ -110,7 +110,7 @@ PTR(Expr) parse_multicand(std::istream &in) {
         PTR(Expr) actual_arg = parse_expr(in);
         if(get_next(in) != ')')
             throw std::runtime_error((std::string)"bad format");
-        temp = NEW(CallExpr)(temp, actual_arg);
+        temp = CallExpr::make(temp, actual_arg);
     }
     return temp;
 }
@@ -121,6 +121,7 @@ PTR(Expr) parse_multicand(std::istream &in) {
                    | (<expr>)
                    | <variable>
                    | _let <variable> = <expr> _in <expr>
+                   | _letrec <variable> = _fun ( <variable> ) <expr> _in <expr>
                    | _true/_false
                    | _if <expr> _then <expr> _else <expr>
                    | _fun ( <variable> ) <expr>
@@ -140,11 +141,13 @@ PTR(Expr) parse_inner(std::istream &in){
     } else if (c == '_'){
         std::string keyword = parse_keyword(in);
         if (keyword == "_true")
-            return NEW(BoolExpr)(true);
+            return BoolExpr::make(true);
         else if (keyword == "_false")
-            return NEW(BoolExpr)(false);
+            return BoolExpr::make(false);
         else if (keyword == "_let")
-            return parse_let(in);
+            return parse_let(in, false);
+        else if (keyword == "_letrec")
+            return parse_let(in, true);
         else if (keyword == "_if")
             return parse_if(in);
         else if (keyword == "_fun")
@@ -161,12 +164,13 @@ PTR(Expr) parse_if(std::istream &in){
     PTR(Expr) then_part = parse_expr(in);
     if(parse_keyword(in) != "_else") throw std::runtime_error((std::string)"unexpected keyword");
     PTR(Expr) else_part = parse_expr(in);
-    return NEW(IfExpr)(test_part, then_part, else_part);
+    return IfExpr::make(test_part, then_part, else_part);
 }
 
-PTR(Expr) parse_let(std::istream &in){
+// A `_letrec` binds a function, which its body can call by the name
+PTR(Expr) parse_let(std::istream &in, bool recursive){
     peek_next(in);
-    std::string variable = parse_alphabetic(in, "");
+    Symbol variable = parse_alphabetic(in, "");
     char c = peek_next(in);
     if(c != '=')
         throw std::runtime_error((std::string)"Should have = keyword");
@@ -176,7 +180,12 @@ PTR(Expr) parse_let(std::istream &in){
     if(in_string != "_in")
         throw std::runtime_error((std::string)"Should have _in keyword");
     PTR(Expr) se = parse_expr(in);
-    return NEW(LetExpr)(variable, fe, se);
+    if(recursive){
+        if(fe == nullptr || fe->kind != Expr::func_expr)
+            throw std::runtime_error((std::string)"_letrec should bind a function");
+        return LetRecExpr::make(variable, fe, se);
+    }
+    return LetExpr::make(variable, fe, se);
 }
 
 
@@ -191,13 +200,13 @@ PTR(Expr) parse_number(std::istream &in) {
     if(!isdigit(peek_next(in))) throw std::runtime_error((std::string)"Unexpected number");
     int num = 0;
     in >> num;
-    return NEW(NumExpr)(flag * num);
+    return NumExpr::make(flag * num);
 }
 
 // Parses an expression, assuming that `in` starts with a
 // letter.
 PTR(Expr) parse_variable(std::istream &in) {
-    return NEW(VarExpr)(parse_alphabetic(in, ""));
+    return VarExpr::make(Symbol(parse_alphabetic(in, "")));
 }
 
 // Parse a function
@@ -206,13 +215,13 @@ PTR(Expr) parse_fun(std::istream &in){
     if(c == '('){
         get_next(in);
         peek_next(in);
-        std::string formal_var = parse_alphabetic(in, "");
+        Symbol formal_var = parse_alphabetic(in, "");
         c = peek_next(in);
         if(c != ')')
             throw std::runtime_error((std::string)"not a function format");
         get_next(in);
         PTR(Expr) body = parse_expr(in);
-        return NEW(FuncExpr)(formal_var, body);
+        return FuncExpr::make(formal_var, body);
     } else
         throw std::runtime_error((std::string)"not a function format");
 }
@@ -225,7 +234,8 @@ std::string parse_keyword(std::istream &in) {
 }
 
 // Parses an expression, assuming that `in` starts with a
-// letter.
+// letter. Callers intern variable names as a `Symbol`;
+// keywords stay strings.
 std::string parse_alphabetic(std::istream &in, std::string prefix) {
     std::string name = prefix;
     while (1) {
@@ -255,42 +265,43 @@ PTR(Expr) parse_str(std::string s){
 
 
 TEST_CASE( "parse" ) {
-    CHECK((NEW(NumExpr)(1))->equals(NEW(NumExpr)(1)));
-    CHECK(!(NEW(NumExpr)(1))->equals(NEW(NumExpr)(2)));
-    CHECK(!(NEW(NumExpr)(1))->equals(NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(4))));
-    CHECK((NEW(VarExpr)("hello"))->equals(NEW(VarExpr)("hello")));
-    CHECK(!(NEW(VarExpr)("hello"))->equals(NEW(VarExpr)("ello")));
-    CHECK(peek_next(*(NEW(std::istringstream)("hello"))) == 'h');
-    CHECK(peek_next(*(NEW(std::istringstream)("   hello"))) == 'h');
-    CHECK(get_next(*(NEW(std::istringstream)("   hello"))) == 'h');
-    CHECK(parse_str("1")->equals(NEW(NumExpr)(1)));
-    CHECK(parse_str("  1")->equals(NEW(NumExpr)(1)));
-    CHECK(parse_str("4+2")->equals(NEW(AddExpr)(NEW(NumExpr)(4), NEW(NumExpr)(2))));
-    CHECK(parse_str("   45 +    23")->equals(NEW(AddExpr)(NEW(NumExpr)(45), NEW(NumExpr)(23))));
-    CHECK(parse_str("   45   *  23   ")->equals(NEW(MultExpr)(NEW(NumExpr)(45), NEW(NumExpr)(23))));
-    CHECK(parse_str("(90)")->equals(NEW(NumExpr)(90)));
-    CHECK(parse_str("3*(2+43)")->equals(NEW(MultExpr)(NEW(NumExpr)(3),NEW(AddExpr)(NEW(NumExpr)(2), NEW(NumExpr)(43)))));
-    CHECK(parse_str("Hello")->equals(NEW(VarExpr)("Hello")));
-    CHECK(parse_str("3*(2+width)")->equals(NEW(MultExpr)(NEW(NumExpr)(3),NEW(AddExpr)(NEW(NumExpr)(2), NEW(VarExpr)("width")))));
+    CHECK((NumExpr::make(1))->equals(NumExpr::make(1)));
+    CHECK(!(NumExpr::make(1))->equals(NumExpr::make(2)));
+    CHECK(!(NumExpr::make(1))->equals(MultExpr::make(NumExpr::make(2), NumExpr::make(4))));
+    CHECK((VarExpr::make("hello"))->equals(VarExpr::make("hello")));
+    CHECK(!(VarExpr::make("hello"))->equals(VarExpr::make("ello")));
+    std::istringstream in1("hello"), in2("   hello"), in3("   hello");
+    CHECK(peek_next(in1) == 'h');
+    CHECK(peek_next(in2) == 'h');
+    CHECK(get_next(in3) == 'h');
+    CHECK(parse_str("1")->equals(NumExpr::make(1)));
+    CHECK(parse_str("  1")->equals(NumExpr::make(1)));
+    CHECK(parse_str("4+2")->equals(AddExpr::make(NumExpr::make(4), NumExpr::make(2))));
+    CHECK(parse_str("   45 +    23")->equals(AddExpr::make(NumExpr::make(45), NumExpr::make(23))));
+    CHECK(parse_str("   45   *  23   ")->equals(MultExpr::make(NumExpr::make(45), NumExpr::make(23))));
+    CHECK(parse_str("(90)")->equals(NumExpr::make(90)));
+    CHECK(parse_str("3*(2+43)")->equals(MultExpr::make(NumExpr::make(3),AddExpr::make(NumExpr::make(2), NumExpr::make(43)))));
+    CHECK(parse_str("Hello")->equals(VarExpr::make("Hello")));
+    CHECK(parse_str("3*(2+width)")->equals(MultExpr::make(NumExpr::make(3),AddExpr::make(NumExpr::make(2), VarExpr::make("width")))));
 }
 
 
 TEST_CASE("interpreter"){
-    CHECK(parse_str("_let x = (_let y = 7 _in y) _in x")->interp(Env::emptyenv)->equals(NEW(NumVal)(7)));
-    CHECK(parse_str("_let x = 5 _in _let y = x _in y + y")->interp(Env::emptyenv)->equals(NEW(NumVal)(10)));
-    CHECK(parse_str("_let x = 6 _in _let x = 19 _in x")->interp(Env::emptyenv)->equals(NEW(NumVal)(19)));
-    CHECK(parse_str("_if 5 == 3 _then 2 _else 89")->interp(Env::emptyenv)->equals(NEW(NumVal)(89)));
-    CHECK(parse_str("-8 + 3")->interp(Env::emptyenv)->equals(NEW(NumVal)(-5)));
+    CHECK(parse_str("_let x = (_let y = 7 _in y) _in x")->interp(Env::emptyenv).equals(Value::num(7)));
+    CHECK(parse_str("_let x = 5 _in _let y = x _in y + y")->interp(Env::emptyenv).equals(Value::num(10)));
+    CHECK(parse_str("_let x = 6 _in _let x = 19 _in x")->interp(Env::emptyenv).equals(Value::num(19)));
+    CHECK(parse_str("_if 5 == 3 _then 2 _else 89")->interp(Env::emptyenv).equals(Value::num(89)));
+    CHECK(parse_str("-8 + 3")->interp(Env::emptyenv).equals(Value::num(-5)));
 }
 
 TEST_CASE("function"){
-    CHECK(parse_str("_fun (x) x + 1")->equals(NEW(FuncExpr)("x", NEW(AddExpr)( NEW(VarExpr)("x"), NEW(NumExpr)(1)))));
-    CHECK(parse_str("_let f = _fun (x) x + 1 _in f(10)")->interp(Env::emptyenv)->equals(NEW(NumVal)(11)));
-    CHECK(parse_str("_let y = 8 _in _let f = _fun (x) x * y _in f(2)")->interp(Env::emptyenv)->equals(NEW(NumVal)(16)));
-    CHECK(parse_str("(_fun (x) x + 2)(1)")->interp(Env::emptyenv)->equals(NEW(NumVal)(3)));
-    CHECK(parse_str("_let f = _fun (x) _fun (y) x*x + y*y _in (f(2))(3)")->interp(Env::emptyenv)->equals(NEW(NumVal)(13)));
-    CHECK(parse_str("_let f = _fun (x) _fun (y) x*x + y*y _in f(2)(3)")->interp(Env::emptyenv)->equals(NEW(NumVal)(13)));
-    CHECK(parse_str("_let add = _fun (x) _fun (y) x + y _in _let addFive = add(5) _in addFive(10)")->interp(Env::emptyenv)->equals(NEW(NumVal)(15)));
+    CHECK(parse_str("_fun (x) x + 1")->equals(FuncExpr::make("x", AddExpr::make( VarExpr::make("x"), NumExpr::make(1)))));
+    CHECK(parse_str("_let f = _fun (x) x + 1 _in f(10)")->interp(Env::emptyenv).equals(Value::num(11)));
+    CHECK(parse_str("_let y = 8 _in _let f = _fun (x) x * y _in f(2)")->interp(Env::emptyenv).equals(Value::num(16)));
+    CHECK(parse_str("(_fun (x) x + 2)(1)")->interp(Env::emptyenv).equals(Value::num(3)));
+    CHECK(parse_str("_let f = _fun (x) _fun (y) x*x + y*y _in (f(2))(3)")->interp(Env::emptyenv).equals(Value::num(13)));
+    CHECK(parse_str("_let f = _fun (x) _fun (y) x*x + y*y _in f(2)(3)")->interp(Env::emptyenv).equals(Value::num(13)));
+    CHECK(parse_str("_let add = _fun (x) _fun (y) x + y _in _let addFive = add(5) _in addFive(10)")->interp(Env::emptyenv).equals(Value::num(15)));
 }
 
 TEST_CASE("recursive functions"){
@@ -300,7 +311,7 @@ TEST_CASE("recursive functions"){
                      "                  _then 1"
                      "                  _else x * factrl(factrl)(x + -1)"
                      "_in factrl(factrl)(5)")
-          ->interp(Env::emptyenv)->to_string() == "120" );
+          ->interp(Env::emptyenv).to_string() == "120" );
     CHECK( parse_str("_let fib = _fun (fib)"
                      "              _fun (x)"
                      "                 _if x == 0"
@@ -309,7 +320,15 @@ TEST_CASE("recursive functions"){
                      "                 _then 1"
                      "                 _else fib(fib)(x + -1)"
                      "                       + fib(fib)(x + -2)"
-                     "_in fib(fib)(10)")->interp(Env::emptyenv)->to_string() == "89");
+                     "_in fib(fib)(10)")->interp(Env::emptyenv).to_string() == "89");
+    CHECK( parse_str("_letrec factrl = _fun (x)"
+                     "                   _if x == 1"
+                     "                   _then 1"
+                     "                   _else x * factrl(x + -1)"
+                     "_in factrl(5)")
+          ->interp(Env::emptyenv).to_string() == "120" );
+    CHECK( parse_str("_letrec f = (_fun (x) f(x)) _in f")->equals(parse_str("_letrec f = _fun (x) f(x) _in f")) );
+    CHECK_THROWS_WITH( parse_str("_letrec f = _let g = _fun (x) x _in g _in f"), "_letrec should bind a function" );
 }
 
 TEST_CASE("continuation"){
@@ -319,7 +338,7 @@ TEST_CASE("continuation"){
                                            "                  _then 1"
                                            "                  _else x * factrl(factrl)(x + -1)"
                                            "_in factrl(factrl)(5)"))
-          ->to_string() == "120" );
+          .to_string() == "120" );
     CHECK( (Step::interp_by_steps)(parse_str("_let fib = _fun (fib)"
                                            "              _fun (x)"
                                            "                 _if x == 0"
@@ -328,7 +347,7 @@ TEST_CASE("continuation"){
                                            "                 _then 1"
                                            "                 _else fib(fib)(x + -1)"
                                            "                       + fib(fib)(x + -2)"
-                                           "_in fib(fib)(10)"))->to_string() == "89");
+                                           "_in fib(fib)(10)")).to_string() == "89");
     
-    CHECK( Step::interp_by_steps(parse_str("_let countdown = _fun(countdown) _fun(n) _if n == 0 _then 0 _else countdown(countdown)(n + -1) _in countdown(countdown)(1000000)")));
+    CHECK( Step::interp_by_steps(parse_str("_let countdown = _fun(countdown) _fun(n) _if n == 0 _then 0 _else countdown(countdown)(n + -1) _in countdown(countdown)(1000000)")).equals(Value::num(0)) );
 }
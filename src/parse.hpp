@@ -16,5 +16,6 @@
 class Expr;
 
 PTR(Expr) parse(std::istream &in);
+PTR(Expr) parse_str(std::string s);
 
 #endif /* parse_h */
@@ -9,15 +9,80 @@
 #ifndef pointer_hpp
 #define pointer_hpp
 
+#include <memory>
+
+// 1: raw pointers that are never freed, 0: std::shared_ptr
+#ifndef ENABLE_SMART_POINTER
 #define ENABLE_SMART_POINTER 0
+#endif
+
+// 1: intrusive, non-atomic reference counting (see refcount.hpp)
+#ifndef ENABLE_REFCOUNT
+#define ENABLE_REFCOUNT 0
+#endif
+
+// 1: raw pointers into the current Arena, freed with it (see arena.hpp)
+#ifndef ENABLE_ARENA
+#define ENABLE_ARENA 0
+#endif
+
+// 1: raw pointers into a heap freed by tracing garbage collection (see gc.hpp)
+#ifndef ENABLE_GC
+#define ENABLE_GC 0
+#endif
+
+/* UNIQUE(p) is true when `p` is the only pointer to its
+ object, so the object can be reused; it is always false
+ where pointers are not counted. */
+#if ENABLE_GC
+
+#include "gc.hpp"
+
+#define NEW(T) gc_new<T>
+#define PTR(T) T*
+#define CAST(T) dynamic_cast<T*>
+#define THIS this
+#define ENABLE_THIS(T) : public Managed
+#define RAW(p) (p)
+#define PTR_OF(p) (p)
+#define UNIQUE(p) ((void)(p), false)
+
+#elif ENABLE_ARENA
+
+#include "arena.hpp"
+
+#define NEW(T) arena_new<T>
+#define PTR(T) T*
+#define CAST(T) dynamic_cast<T*>
+#define THIS this
+#define ENABLE_THIS(T) /* empty */
+#define RAW(p) (p)
+#define PTR_OF(p) (p)
+#define UNIQUE(p) ((void)(p), false)
+
+#elif ENABLE_REFCOUNT
+
+#include "refcount.hpp"
+
+#define NEW(T) make_ref<T>
+#define PTR(T) Ref<T>
+#define CAST(T) ref_cast<T>
+#define THIS ref_to(this)
+#define ENABLE_THIS(T) : public RefCounted
+#define RAW(p) (p).get()
+#define PTR_OF(p) ref_to(p)
+#define UNIQUE(p) ((p)->refcount == 1)
 
-#if ENABLE_SMART_POINTER
+#elif ENABLE_SMART_POINTER
 
 #define NEW(T) new T
 #define PTR(T) T*
 #define CAST(T) dynamic_cast<T*>
 #define THIS this
 #define ENABLE_THIS(T) /* empty */
+#define RAW(p) (p)
+#define PTR_OF(p) (p)
+#define UNIQUE(p) ((void)(p), false)
 
 #else
 
@@ -26,6 +91,9 @@
 #define CAST(T) std::dynamic_pointer_cast<T>
 #define THIS shared_from_this()
 #define ENABLE_THIS(T) : public std::enable_shared_from_this<T>
+#define RAW(p) (p).get()
+#define PTR_OF(p) (p)->shared_from_this()
+#define UNIQUE(p) ((p).use_count() == 1)
 
 #endif
 #endif /* pointer_hpp */
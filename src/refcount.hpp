@@ -0,0 +1,90 @@
+//
+//  refcount.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/17/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef refcount_hpp
+#define refcount_hpp
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+/* Base of every object with ENABLE_REFCOUNT: the number of
+ `Ref`s to it, kept in the object itself. The count is a
+ plain int, so an object must only be used by one thread. */
+class RefCounted {
+public:
+    int refcount = 0;
+    
+    virtual ~RefCounted() {}
+};
+
+/* Intrusive reference-counting pointer, used as PTR(T) with
+ ENABLE_REFCOUNT. Unlike std::shared_ptr it has no control
+ block or weak count, copying is a non-atomic increment,
+ and moving touches no count at all. Any raw pointer to a
+ live object can be made into a `Ref` again, so `THIS`
+ needs no `enable_shared_from_this`. */
+template <class T> class Ref {
+public:
+    Ref() : p(nullptr) {}
+    Ref(std::nullptr_t) : p(nullptr) {}
+    explicit Ref(T *p) : p(p) { retain(); }
+    Ref(const Ref &other) : p(other.p) { retain(); }
+    Ref(Ref &&other) : p(other.p) { other.p = nullptr; }
+    template <class U, class = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    Ref(const Ref<U> &other) : p(other.p) { retain(); }
+    template <class U, class = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    Ref(Ref<U> &&other) : p(other.p) { other.p = nullptr; }
+    ~Ref() { release(); }
+
+    // By value, so it is a copy or a move as the argument allows
+    Ref &operator=(Ref other) {
+        std::swap(p, other.p);
+        return *this;
+    }
+
+    T *operator->() const { return p; }
+    T &operator*() const { return *p; }
+    T *get() const { return p; }
+    explicit operator bool() const { return p != nullptr; }
+
+private:
+    template <class U> friend class Ref;
+
+    T *p;
+
+    void retain() {
+        if (p != nullptr)
+            p->refcount++;
+    }
+    void release() {
+        if (p != nullptr && --p->refcount == 0)
+            delete p;
+    }
+};
+
+template <class T, class U> bool operator==(const Ref<T> &a, const Ref<U> &b) { return a.get() == b.get(); }
+template <class T, class U> bool operator!=(const Ref<T> &a, const Ref<U> &b) { return a.get() != b.get(); }
+template <class T> bool operator==(const Ref<T> &a, std::nullptr_t) { return a.get() == nullptr; }
+template <class T> bool operator!=(const Ref<T> &a, std::nullptr_t) { return a.get() != nullptr; }
+template <class T> bool operator==(std::nullptr_t, const Ref<T> &a) { return a.get() == nullptr; }
+template <class T> bool operator!=(std::nullptr_t, const Ref<T> &a) { return a.get() != nullptr; }
+
+template <class T, class... Args> Ref<T> make_ref(Args&&... args) {
+    return Ref<T>(new T(std::forward<Args>(args)...));
+}
+
+template <class T> Ref<T> ref_to(T *p) {
+    return Ref<T>(p);
+}
+
+template <class T, class U> Ref<T> ref_cast(const Ref<U> &p) {
+    return Ref<T>(dynamic_cast<T*>(p.get()));
+}
+
+#endif /* refcount_hpp */
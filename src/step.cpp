@@ -11,29 +11,234 @@
 #include "expr.hpp"
 #include "env.hpp"
 #include "value.hpp"
+#include "arena.hpp"
+#include "gc.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
 
-Step::mode_t Step::mode;
+Step::Step() {
+    GC::heap().add_roots(this, [](void *p, GC &gc) { static_cast<Step*>(p)->trace(gc); });
+}
 
-PTR(Cont) Step::cont;
-PTR(Expr) Step::expr; /* only for Step::interp_mode */
-PTR(Env) Step::env;
-PTR(Val) Step::val;        /* only for Step::continue_mode */
+Step::~Step() {
+    GC::heap().remove_roots(this);
+}
 
-PTR(Val) Step::interp_by_steps(PTR(Expr) e) {
-    Step::mode = Step::interp_mode;
-    Step::expr = e;
-    Step::env = Env::emptyenv;
-    Step::val = nullptr;
-    Step::cont = Cont::done;
-    
-    while (1) {
-        if (Step::mode == Step::interp_mode)
-            Step::expr->step_interp();
-        else {
-            if (Step::cont == Cont::done)
-                return Step::val;
-            else
-                Step::cont->step_continue();
+void Step::start(PTR(Expr) e) {
+    program = e;
+    mode = interp_mode;
+    expr = RAW(e);
+    env = Env::emptyenv;
+    val = Value();
+    frames.clear();
+    cont = Cont::done;
+}
+
+bool Step::take_step() {
+    if (mode == interp_mode)
+        expr->step_interp(*this);
+    else if (!frames.empty())
+        continue_frame();
+    else {
+        if (cont == Cont::done)
+            return false;
+        else
+            cont->step_continue(*this);
+    }
+    return true;
+}
+
+void Step::push_frame(Frame::kind_t kind, Expr *e, Expr *else_part, Symbol var) {
+    frames.push_back(Frame());
+    Frame &f = frames.back();
+    f.kind = kind;
+    f.expr = e;
+    f.else_part = else_part;
+    f.var = var;
+    f.env = env;
+}
+
+void Step::continue_frame() {
+    Frame &f = frames.back();
+    switch (f.kind) {
+        case Frame::right_then_add:
+        case Frame::right_then_mult:
+        case Frame::right_then_comp:
+        case Frame::arg_then_call:
+            // Keep the first value in the frame and evaluate the second
+            f.kind = (f.kind == Frame::right_then_add ? Frame::add
+                      : f.kind == Frame::right_then_mult ? Frame::mult
+                      : f.kind == Frame::right_then_comp ? Frame::comp
+                      : Frame::call);
+            f.val = std::move(val);
+            mode = interp_mode;
+            expr = f.expr;
+            env = std::move(f.env);
+            break;
+        case Frame::add:
+            val = f.val.add_to(val);
+            frames.pop_back();
+            break;
+        case Frame::mult:
+            val = f.val.mult_with(val);
+            frames.pop_back();
+            break;
+        case Frame::comp:
+            val = Value::boolean(f.val.equals(val));
+            frames.pop_back();
+            break;
+        case Frame::call: {
+            Value to_be_called = std::move(f.val);
+            frames.pop_back();
+            to_be_called.call_step(std::move(val), cont, *this);
+            break;
+        }
+        case Frame::if_branch: {
+            if (val.kind != Value::bool_kind)
+                throw std::runtime_error("if part doesn't evaluate to a bool val!");
+            expr = val.rep ? f.expr : f.else_part;
+            env = std::move(f.env);
+            mode = interp_mode;
+            frames.pop_back();
+            break;
+        }
+        case Frame::let_body:
+            env = NEW(ExtendedEnv)(f.var, std::move(val), std::move(f.env));
+            expr = f.expr;
+            mode = interp_mode;
+            frames.pop_back();
+            break;
+        case Frame::memoize: {
+            ExtendedEnv *call = static_cast<ExtendedEnv*>(RAW(f.env));
+            memo.store(Memo::Key(PTR_OF(f.expr), call->rest, call->val), val);
+            frames.pop_back();
+            break;
+        }
+    }
+}
+
+PTR(Cont) Step::capture_cont() {
+    // frames[0] is the oldest, so it wraps `cont` first
+    for (size_t i = 0; i < frames.size(); i++) {
+        Frame &f = frames[i];
+        switch (f.kind) {
+            case Frame::right_then_add:
+                cont = NEW(RightThenAddCont)(PTR_OF(f.expr), f.env, cont);
+                break;
+            case Frame::add:
+                cont = NEW(AddCont)(f.val, cont);
+                break;
+            case Frame::right_then_mult:
+                cont = NEW(RightThenMultCont)(PTR_OF(f.expr), f.env, cont);
+                break;
+            case Frame::mult:
+                cont = NEW(MultCont)(f.val, cont);
+                break;
+            case Frame::right_then_comp:
+                cont = NEW(RightThenCompCont)(PTR_OF(f.expr), f.env, cont);
+                break;
+            case Frame::comp:
+                cont = NEW(CompCont)(f.val, cont);
+                break;
+            case Frame::arg_then_call:
+                cont = NEW(ArgThenCallCont)(PTR_OF(f.expr), f.env, cont);
+                break;
+            case Frame::call:
+                cont = NEW(CallCont)(f.val, cont);
+                break;
+            case Frame::if_branch:
+                cont = NEW(IfBranchCont)(PTR_OF(f.expr), PTR_OF(f.else_part), f.env, cont);
+                break;
+            case Frame::let_body:
+                cont = NEW(LetBodyCont)(f.var, PTR_OF(f.expr), f.env, cont);
+                break;
+            case Frame::memoize:
+                cont = NEW(MemoizeCont)(PTR_OF(f.expr), f.env, cont);
+                break;
         }
     }
+    frames.clear();
+    return cont;
+}
+
+Value Step::run(PTR(Expr) e) {
+    size_t region = GC::heap().start_region();
+    start(e);
+    while (take_step())
+        GC::heap().safepoint(region);
+    return val;
+}
+
+void Step::trace(GC &gc) {
+    gc.mark(expr);
+    gc.mark(RAW(env));
+    gc.mark(val);
+    for (Frame &f : frames) {
+        gc.mark(f.expr);
+        gc.mark(f.else_part);
+        gc.mark(RAW(f.env));
+        gc.mark(f.val);
+    }
+    gc.mark(RAW(cont));
+    gc.mark(RAW(program));
+}
+
+Value Step::interp_by_steps(PTR(Expr) e) {
+    Arena arena;
+    Step step;
+    return arena.escape(step.run(Expr::lower_recursion(e)));
+}
+
+TEST_CASE("step machines") {
+    PTR(Expr) factrl = parse_str("_let factrl = _fun(factrl)"
+                                 "                _fun(x)"
+                                 "                  _if x == 1"
+                                 "                  _then 1"
+                                 "                  _else x * factrl(factrl)(x + -1)"
+                                 "_in factrl(factrl)(5)");
+    PTR(Expr) add = parse_str("_let add = _fun (x) _fun (y) x + y _in _let addFive = add(5) _in addFive(10)");
+    
+    // Two machines interleaved step by step don't disturb each other
+    Step a, b;
+    a.start(factrl);
+    b.start(add);
+    bool a_running = true, b_running = true;
+    while (a_running || b_running) {
+        if (a_running) a_running = a.take_step();
+        if (b_running) b_running = b.take_step();
+    }
+    CHECK( a.val.equals(Value::num(120)) );
+    CHECK( b.val.equals(Value::num(15)) );
+    
+    // A machine can be reused once it's done
+    CHECK( a.run(add).equals(Value::num(15)) );
+}
+
+TEST_CASE("frame stack") {
+    PTR(Expr) fib = parse_str("_let fib = _fun (fib)"
+                              "              _fun (x)"
+                              "                 _if x == 0"
+                              "                 _then 1"
+                              "                 _else _if x == 2 + -1"
+                              "                 _then 1"
+                              "                 _else fib(fib)(x + -1)"
+                              "                       + fib(fib)(x + -2)"
+                              "_in fib(fib)(10)");
+    
+    // Capturing the frames as `Cont` objects midway doesn't change the result
+    for (int n = 1; n < 400; n += 37) {
+        Step step;
+        step.start(fib);
+        for (int i = 0; i < n; i++)
+            step.take_step();
+        step.capture_cont();
+        CHECK( step.frames.empty() );
+        while (step.take_step())
+            ;
+        CHECK( step.val.to_string() == "89" );
+    }
+    
+    // The let body sees the let's own env, not the env the rhs ended in
+    CHECK_THROWS( Step::interp_by_steps(parse_str("_let x = (_fun (y) y)(1) _in y")) );
+    CHECK( Step::interp_by_steps(parse_str("_let y = 2 _in _let x = (_fun (y) y)(1) _in x + y")).equals(Value::num(3)) );
 }
@@ -10,15 +10,57 @@
 #define step_hpp
 
 #include <iostream>
+#include <string>
+#include <vector>
 #include "pointer.hpp"
+#include "value.hpp"
+#include "memo.hpp"
 
 class Expr;
 class Cont;
 class Env;
-class Val;
+class GC;
 
+/* A pending continuation on a machine's frame stack.
+ Each kind is the unboxed form of the `Cont` class with
+ the same name. Frames are reused in place where they can
+ be: a `right_then_add` frame becomes an `add` frame once
+ the left value arrives. Expressions are borrowed from the
+ machine's `program`. */
+struct Frame {
+    typedef enum {
+        right_then_add,
+        add,
+        right_then_mult,
+        mult,
+        right_then_comp,
+        comp,
+        arg_then_call,
+        call,
+        if_branch,
+        let_body,
+        memoize
+    } kind_t;
+    
+    kind_t kind;
+    Expr *expr;              // rhs, actual_arg, then_part, let body, called body or called function
+    Expr *else_part;         // only for `if_branch`
+    Symbol var;  // only for `let_body`
+    PTR(Env) env;
+    Value val;               // lhs_val or to_be_called
+};
+
+/* A step machine. Each instance owns its own registers,
+ so separate machines can run on separate threads, or
+ one can be started from inside another's host callback.
+ With ENABLE_GC the registers are roots of the collector
+ for as long as the machine exists, and all machines then
+ share one heap and one thread (see gc.hpp). */
 class Step {
 public:
+    Step();
+    ~Step();
+    
     typedef enum {
         interp_mode,
         continue_mode
@@ -27,29 +69,75 @@ public:
     /* Mode insicates whether the next step is to
      start interpreting an expression or start
      delivering a value to a continuation. */
-    static mode_t mode;
+    mode_t mode;
     
     /* The expression to interpret, meaningful
-     only when `mode` is `interp_mode`: */
-    static PTR(Expr) expr;
+     only when `mode` is `interp_mode`. It is
+     borrowed from `program`: */
+    Expr *expr;
     
-    static PTR(Env) env;
+    PTR(Env) env;
     
     /* The value to be delivered to the continuation,
      meaningful only when `mode` is `continue_mode`: */
-    static PTR(Val) val;
+    Value val;
     
     /* The continuation to receive a value, meaningful
-     only when `mode` is `continue_mode`: */
-    static PTR(Cont) cont;
-    
-    /* Function to interpret an expression by stepping.
-     The function should only be called once to start
-     an expression's interpretation. It must not be
-     called by `step_interp` or `step_continue` (i.e.,
-     it must not be called recursively, since the whole
-     point is to avoid rcursive calls at the C++ level). */
-    static PTR(Val) interp_by_steps(PTR(Expr) e);
+     only when `mode` is `continue_mode`. The frames on
+     top of `frames` come first; `cont` receives the value
+     only once `frames` is empty: */
+    std::vector<Frame> frames;
+    PTR(Cont) cont;
+    
+    /* The expression being run. It keeps alive every
+     expression that `expr` and `frames` point to. */
+    PTR(Expr) program;
+    
+    /* Results of the calls made on this machine, used
+     when `Memo::enabled`. A call that misses pushes a
+     `memoize` frame, which records the call's value. */
+    Memo memo;
+    
+    /* Push a frame of `kind` that saves the current `env`. */
+    void push_frame(Frame::kind_t kind, Expr *e, Expr *else_part = nullptr, Symbol var = Symbol());
+    
+    /* Deliver `val` to the top frame. */
+    void continue_frame();
+    
+    /* Materialize `frames` as a linked chain of `Cont`
+     objects in front of `cont`, and return it. Stepping
+     on from the chain gives the same result as stepping
+     on from the frames, so a host can keep the chain as
+     a first-class continuation. */
+    PTR(Cont) capture_cont();
+    
+    /* Load an expression into the registers, ready
+     to be interpreted by `take_step`. */
+    void start(PTR(Expr) e);
+    
+    /* Take one step. Returns false once the value has
+     been delivered to `Cont::done`, and then `val`
+     holds the result. */
+    bool take_step();
+    
+    /* Start an expression and step until it's done,
+     collecting garbage between steps. */
+    Value run(PTR(Expr) e);
+    
+    // Mark the objects in the registers
+    void trace(GC &gc);
+    
+    /* Function to interpret an expression by stepping
+     on a fresh machine. It should not be called by
+     `step_interp` or `step_continue`: that would work,
+     but the whole point is to avoid rcursive calls at
+     the C++ level. Allocates in its own arena, and runs
+     the program after `Expr::lower_recursion`. */
+    static Value interp_by_steps(PTR(Expr) e);
+    
+private:
+    Step(const Step &) = delete;
+    Step &operator=(const Step &) = delete;
 };
 
 #endif /* step_hpp */
@@ -0,0 +1,59 @@
+//
+//  symbol.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/14/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "symbol.hpp"
+#include <unordered_map>
+#include <vector>
+#include "catch.hpp"
+
+// Function-local so symbols can be made during static initialization
+static std::vector<std::string> &symbol_names(){
+    static std::vector<std::string> names;
+    return names;
+}
+
+static std::unordered_map<std::string, int> &symbol_ids(){
+    static std::unordered_map<std::string, int> ids;
+    return ids;
+}
+
+Symbol::Symbol(){
+    this->id = -1;
+}
+
+Symbol::Symbol(const std::string &name){
+    this->id = intern(name);
+}
+
+Symbol::Symbol(const char *name){
+    this->id = intern(name);
+}
+
+const std::string &Symbol::to_string() const{
+    static const std::string none = "";
+    return id < 0 ? none : symbol_names()[id];
+}
+
+int Symbol::intern(const std::string &name){
+    std::unordered_map<std::string, int>::iterator it = symbol_ids().find(name);
+    if(it != symbol_ids().end())
+        return it->second;
+    int id = (int)symbol_names().size();
+    symbol_names().push_back(name);
+    symbol_ids()[name] = id;
+    return id;
+}
+
+TEST_CASE( "symbols" ) {
+    CHECK( Symbol("x") == Symbol(std::string("x")) );
+    CHECK( Symbol("x").id == Symbol("x").id );
+    CHECK( Symbol("x") != Symbol("y") );
+    CHECK( Symbol("longer_than_sixteen_chars").to_string() == "longer_than_sixteen_chars" );
+    CHECK( Symbol() != Symbol("") );
+    CHECK( Symbol().to_string() == "" );
+}
@@ -0,0 +1,39 @@
+//
+//  symbol.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/14/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef symbol_hpp
+#define symbol_hpp
+
+#include <string>
+
+/* An interned variable name. Every distinct name gets a small
+ integer id from one global table the first time it is seen,
+ normally by the parser, so comparing or copying a Symbol is
+ comparing or copying an int. Names are never removed from
+ the table. Interning is not thread-safe: parse before
+ starting machines on other threads. */
+class Symbol {
+public:
+    int id;
+    
+    Symbol();  // no name, equal to no interned symbol
+    Symbol(const std::string &name);
+    Symbol(const char *name);
+    
+    const std::string &to_string() const;
+    
+    bool operator==(Symbol other) const { return id == other.id; }
+    bool operator!=(Symbol other) const { return id != other.id; }
+    // Order of interning, not alphabetical
+    bool operator<(Symbol other) const { return id < other.id; }
+    
+private:
+    static int intern(const std::string &name);
+};
+
+#endif /* symbol_hpp */
@@ -11,115 +11,122 @@
 #include "catch.hpp"
 #include "env.hpp"
 #include "step.hpp"
+#include "cont.hpp"
+#include "gc.hpp"
+#include "jit.hpp"
 
-NumVal::NumVal(int rep){
-    this->rep = rep;
+Value Value::object(PTR(Val) obj){
+    Value v;
+    v.obj = obj;
+    return v;
 }
 
-bool NumVal::equals(PTR(Val) other_val){
-    PTR(NumVal) nv = CAST(NumVal)(other_val);
-    if(nv == nullptr)
-        return false;
-    else
-        return rep == nv->rep;
+bool Value::other_equals(Value other_val){
+    return obj->equals(other_val);
 }
 
-PTR(Val) NumVal::add_to(PTR(Val) other_val){
-    PTR(NumVal) nv = CAST(NumVal)(other_val);
-    if(nv == nullptr)
+Value Value::other_add_to(Value other_val){
+    if(kind == num_kind)
         throw std::runtime_error((std::string)"Addend is not a number");
+    else if(kind == bool_kind)
+        throw std::runtime_error((std::string)"No adding booleans");
     else
-        return NEW(NumVal)(rep + nv->rep);
+        return obj->add_to(other_val);
 }
 
-PTR(Val) NumVal::mult_with(PTR(Val) other_val){
-    PTR(NumVal) nv = CAST(NumVal)(other_val);
-    if(nv == nullptr)
+Value Value::other_mult_with(Value other_val){
+    if(kind == num_kind)
         throw std::runtime_error((std::string)"Mult is not a number");
+    else if(kind == bool_kind)
+        throw std::runtime_error((std::string)"No multiplying booleans");
     else
-        return NEW(NumVal)(rep * nv->rep);
-}
-
-bool NumVal::is_ture(){
-    throw std::runtime_error((std::string)"evaluate non-boolean");
-}
-
-PTR(Expr) NumVal::to_expr(){
-    return NEW(NumExpr)(rep);
-}
-
-PTR(Val) NumVal::call(PTR(Val) actual_arg){
-    throw std::runtime_error("not call a num");
+        return obj->mult_with(other_val);
 }
 
-void NumVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest){
-    throw std::runtime_error("not call a num");
-}
-
-std::string NumVal::to_string(){
-    return std::to_string(rep);
-}
-
-BoolVal::BoolVal(bool rep){
-    this->rep = rep;
-}
-
-bool BoolVal::equals(PTR(Val) other_val){
-    PTR(BoolVal) bv = CAST(BoolVal)(other_val);
-    if(bv == nullptr)
-        return false;
+bool Value::other_is_ture(){
+    if(kind == num_kind)
+        throw std::runtime_error((std::string)"evaluate non-boolean");
     else
-        return rep == bv->rep;
-}
-
-PTR(Val) BoolVal::add_to(PTR(Val) other_val){
-    throw std::runtime_error((std::string)"No adding booleans");
+        return obj->is_ture();
 }
 
-PTR(Val) BoolVal::mult_with(PTR(Val) other_val){
-    throw std::runtime_error((std::string)"No multiplying booleans");
-}
-
-PTR(Expr) BoolVal::to_expr(){
-    return NEW(BoolExpr)(rep);
-}
-
-bool BoolVal::is_ture(){
-    return rep;
+PTR(Expr) Value::to_expr(){
+    if(kind == num_kind)
+        return NumExpr::make(rep);
+    else if(kind == bool_kind)
+        return BoolExpr::make(rep);
+    else
+        return obj->to_expr();
 }
 
-PTR(Val) BoolVal::call(PTR(Val) actual_arg){
-    throw std::runtime_error("not call a bool");
+Value Value::call(Value actual_arg){
+    if(kind == num_kind)
+        throw std::runtime_error("not call a num");
+    else if(kind == bool_kind)
+        throw std::runtime_error("not call a bool");
+    else
+        return obj->call(actual_arg);
 }
 
-void BoolVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest){
-    throw std::runtime_error("not call a bool");
+void Value::call_step(Value actual_arg_val, PTR(Cont) rest, Step &step){
+    if(kind == num_kind)
+        throw std::runtime_error("not call a num");
+    else if(kind == bool_kind)
+        throw std::runtime_error("not call a bool");
+    else
+        obj->call_step(actual_arg_val, rest, step);
 }
 
-std::string BoolVal::to_string()
-{
-    if (rep)
-        return "_true";
+std::string Value::to_string(){
+    if(kind == num_kind)
+        return std::to_string(rep);
+    else if(kind == bool_kind)
+        return rep ? "_true" : "_false";
     else
-        return "_false";
+        return obj->to_string();
 }
 
-FuncVal::FuncVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env){
+FuncVal::FuncVal(Symbol formal_arg, PTR(Expr) body, PTR(Env) env, Symbol self, bool self_applied){
+    this->kind = Val::func_val;
     this->formal_arg = formal_arg;
     this->body = body;
     this->env = env;
+    this->self = self;
+    this->self_applied = self_applied;
+    this->fun = FuncExpr::make(formal_arg, body, self, self_applied);
+}
+
+FuncVal::FuncVal(PTR(Expr) fun, PTR(Env) env){
+    FuncExpr *f = static_cast<FuncExpr*>(RAW(fun));
+    this->kind = Val::func_val;
+    this->formal_arg = f->formal_arg;
+    this->body = f->body;
+    this->env = env;
+    this->self = f->self;
+    this->self_applied = f->self_applied;
+    this->fun = fun;
+}
+
+PTR(ExtendedEnv) FuncVal::frame(Value actual_arg){
+    if(self == Symbol())
+        return NEW(ExtendedEnv)(formal_arg, actual_arg, env);
+    return NEW(CallEnv)(formal_arg, actual_arg, self, Value::object(THIS), env);
 }
 
-bool FuncVal::equals(PTR(Val) other_val){
-    PTR(FuncVal) fv = CAST(FuncVal)(other_val);
+bool FuncVal::equals(Value other_val){
+    if(other_val.kind != Value::obj_kind || other_val.obj->kind != Val::func_val)
+        return false;
+    FuncVal *fv = static_cast<FuncVal*>(RAW(other_val.obj));
+    if(self != fv->self || self_applied != fv->self_applied)
+        return to_expr()->equals(fv->to_expr());
     return formal_arg == fv->formal_arg && body->equals(fv->body);
 }
 
-PTR(Val) FuncVal::add_to(PTR(Val) other_val){
+Value FuncVal::add_to(Value other_val){
     throw std::runtime_error((std::string)"No adding functions");
 }
 
-PTR(Val) FuncVal::mult_with(PTR(Val) other_val){
+Value FuncVal::mult_with(Value other_val){
     throw std::runtime_error((std::string)"No multiplying functions");
 }
 
@@ -128,63 +135,115 @@ bool FuncVal::is_ture(){
 }
 
 PTR(Expr) FuncVal::to_expr(){
-    return NEW(FuncExpr)(formal_arg, body);
+    return CAST(FuncExpr)(fun)->source();
+}
+
+Value FuncVal::call(Value actual_arg){
+    Value result;
+    if(Jit::enabled && Jit::call(this, actual_arg, result))
+        return result;
+    return body->interp(frame(actual_arg));
+}
+
+void FuncVal::call_step(Value actual_arg_val, PTR(Cont) rest, Step &step){
+    if(Memo::enabled && step.memo.find(Memo::Key(fun, env, actual_arg_val), step.val)){
+        step.mode = Step::continue_mode;
+        step.cont = rest;
+        return;
+    }
+    if(Jit::enabled && Jit::call(this, actual_arg_val, step.val)){
+        if(Memo::enabled)
+            step.memo.store(Memo::Key(fun, env, actual_arg_val), step.val);
+        step.mode = Step::continue_mode;
+        step.cont = rest;
+        return;
+    }
+    step.mode = Step::interp_mode;
+    step.expr = RAW(body);
+    step.env = frame(actual_arg_val);
+    step.cont = rest;
+    if(Memo::enabled)
+        step.push_frame(Frame::memoize, RAW(fun));
 }
 
-PTR(Val) FuncVal::call(PTR(Val) actual_arg){
-    return body->interp(NEW(ExtendedEnv)(formal_arg, actual_arg, env));
-}
-
-void FuncVal::call_step(PTR(Val) actual_arg_val, PTR(Cont) rest){
-    Step::mode = Step::interp_mode;
-    Step::expr = body;
-    Step::env = NEW(ExtendedEnv)(formal_arg, actual_arg_val, env);
-    Step::cont = rest;
+std::string FuncVal::to_string(){
+    if(self != Symbol())
+        return to_expr()->to_string();
+    return "_fun (" + formal_arg.to_string() + ") " + body->to_string();
 }
 
-std::string FuncVal::to_string(){
-    return "_fun (" + formal_arg + ") " + body->to_string();
+void FuncVal::trace(GC &gc){
+    gc.mark(RAW(body));
+    gc.mark(RAW(fun));
+    gc.mark(RAW(env));
 }
 
 TEST_CASE( "values equals" ) {
-    CHECK( (NEW(NumVal)(5))->equals(NEW(NumVal)(5)) );
-    CHECK( ! (NEW(NumVal)(7))->equals(NEW(NumVal)(5)) );
+    CHECK( Value::num(5).equals(Value::num(5)) );
+    CHECK( ! Value::num(7).equals(Value::num(5)) );
     
-    CHECK( (NEW(BoolVal)(true))->equals(NEW(BoolVal)(true)) );
-    CHECK( ! (NEW(BoolVal)(true))->equals(NEW(BoolVal)(false)) );
-    CHECK( ! (NEW(BoolVal)(false))->equals(NEW(BoolVal)(true)) );
+    CHECK( Value::boolean(true).equals(Value::boolean(true)) );
+    CHECK( ! Value::boolean(true).equals(Value::boolean(false)) );
+    CHECK( ! Value::boolean(false).equals(Value::boolean(true)) );
     
-    CHECK( ! (NEW(NumVal)(7))->equals(NEW(BoolVal)(false)) );
-    CHECK( ! (NEW(BoolVal)(false))->equals(NEW(NumVal)(8)) );
+    CHECK( ! Value::num(7).equals(Value::boolean(false)) );
+    CHECK( ! Value::boolean(false).equals(Value::num(8)) );
 }
 
 TEST_CASE( "add_to" ) {
     
-    CHECK ( (NEW(NumVal)(5))->add_to(NEW(NumVal)(8))->equals(NEW(NumVal)(13)) );
+    CHECK ( Value::num(5).add_to(Value::num(8)).equals(Value::num(13)) );
     
-    CHECK_THROWS_WITH ( (NEW(NumVal)(5))->add_to(NEW(BoolVal)(false)), "Addend is not a number" );
-    CHECK_THROWS_WITH ( (NEW(BoolVal)(false))->add_to(NEW(BoolVal)(false)),
+    CHECK_THROWS_WITH ( Value::num(5).add_to(Value::boolean(false)), "Addend is not a number" );
+    CHECK_THROWS_WITH ( Value::boolean(false).add_to(Value::boolean(false)),
                        "No adding booleans" );
 }
 
 TEST_CASE( "mult_with" ) {
     
-    CHECK ( (NEW(NumVal)(5))->mult_with(NEW(NumVal)(8))->equals(NEW(NumVal)(40)) );
+    CHECK ( Value::num(5).mult_with(Value::num(8)).equals(Value::num(40)) );
     
-    CHECK_THROWS_WITH ( (NEW(NumVal)(5))->mult_with(NEW(BoolVal)(false)), "Mult is not a number" );
-    CHECK_THROWS_WITH ( (NEW(BoolVal)(false))->mult_with(NEW(BoolVal)(false)),
+    CHECK_THROWS_WITH ( Value::num(5).mult_with(Value::boolean(false)), "Mult is not a number" );
+    CHECK_THROWS_WITH ( Value::boolean(false).mult_with(Value::boolean(false)),
                        "No multiplying booleans" );
 }
 
 TEST_CASE( "value to_expr" ) {
-    CHECK( (NEW(NumVal)(5))->to_expr()->equals(NEW(NumExpr)(5)) );
-    CHECK( (NEW(BoolVal)(true))->to_expr()->equals(NEW(BoolExpr)(true)) );
-    CHECK( (NEW(BoolVal)(false))->to_expr()->equals(NEW(BoolExpr)(false)) );
+    CHECK( Value::num(5).to_expr()->equals(NumExpr::make(5)) );
+    CHECK( Value::boolean(true).to_expr()->equals(BoolExpr::make(true)) );
+    CHECK( Value::boolean(false).to_expr()->equals(BoolExpr::make(false)) );
 }
 
 TEST_CASE( "value to_string" ) {
-    CHECK( (NEW(NumVal)(5))->to_string() == "5" );
-    CHECK( (NEW(BoolVal)(true))->to_string() == "_true" );
-    CHECK( (NEW(BoolVal)(false))->to_string() == "_false" );
+    CHECK( Value::num(5).to_string() == "5" );
+    CHECK( Value::boolean(true).to_string() == "_true" );
+    CHECK( Value::boolean(false).to_string() == "_false" );
 }
 
+TEST_CASE( "immediate values" ) {
+    CHECK( Value::num(2).add_to(Value::num(3)).equals(Value::num(5)) );
+    CHECK( Value::num(4).mult_with(Value::num(-3)).equals(Value::num(-12)) );
+    CHECK( ! Value::num(1).equals(Value::boolean(true)) );
+    CHECK( Value::boolean(false).equals(Value::boolean(false)) );
+    
+    CHECK_THROWS_WITH( Value::num(1).call(Value::num(2)), "not call a num" );
+    CHECK_THROWS_WITH( Value::boolean(true).add_to(Value::num(2)), "No adding booleans" );
+    CHECK_THROWS_WITH( Value::num(3).is_ture(), "evaluate non-boolean" );
+}
+
+#if ENABLE_REFCOUNT
+TEST_CASE( "refcount" ) {
+    PTR(Val) v = NEW(FuncVal)("x", VarExpr::make("x"), Env::emptyenv);
+    CHECK( v->refcount == 1 );
+    {
+        PTR(Val) copy = v;
+        CHECK( v->refcount == 2 );
+        PTR(Val) moved = std::move(copy);
+        CHECK( v->refcount == 2 );
+        CHECK( copy == nullptr );
+    }
+    CHECK( v->refcount == 1 );
+    CHECK( PTR_OF(RAW(v)) == v );
+    CHECK( CAST(FuncVal)(v)->formal_arg == Symbol("x") );
+}
+#endif
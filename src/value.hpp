@@ -11,68 +11,117 @@
 
 #include <string>
 #include "pointer.hpp"
+#include "symbol.hpp"
 
 class Expr; // Forward Declaration
 class Env;
+class ExtendedEnv;
 class Cont;
+class Step;
+class GC;
+class Val;
 
-class Val ENABLE_THIS(Val){
-public:
-    virtual bool equals(PTR(Val) other_val) = 0;
-    virtual PTR(Val) add_to(PTR(Val) other_val) = 0;
-    virtual PTR(Val) mult_with(PTR(Val) other_val) = 0;
-    virtual bool is_ture() = 0;
-    virtual PTR(Expr) to_expr() = 0;
-    virtual PTR(Val) call(PTR(Val) actual_arg) = 0;
-    virtual void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest) = 0;
-    virtual std::string to_string() = 0;
-};
-
-class NumVal : public Val{
+/* A value passed by value. Numbers and booleans are stored
+ unboxed in `rep`, so computing with them never allocates;
+ only functions live on the heap, as a `Val` in `obj`. */
+class Value {
 public:
-    int rep;  // representation of the val: int or bool
+    typedef enum {
+        num_kind,
+        bool_kind,
+        obj_kind
+    } kind_t;
     
-    NumVal(int rep);
-    bool equals(PTR(Val) other_val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
-    bool is_ture();
+    kind_t kind;
+    int rep;       // the number, or the boolean as 0/1
+    PTR(Val) obj;  // only for obj_kind
+    
+    Value() : kind(obj_kind), rep(0), obj(nullptr) {}
+    static Value num(int rep) { Value v; v.kind = num_kind; v.rep = rep; return v; }
+    static Value boolean(bool rep) { Value v; v.kind = bool_kind; v.rep = rep; return v; }
+    // Wrap a function on the heap
+    static Value object(PTR(Val) obj);
+    
+    // Numbers and booleans are handled inline, the rest out of line
+    bool equals(Value other_val) {
+        if(kind != obj_kind)
+            return kind == other_val.kind && rep == other_val.rep;
+        return other_equals(other_val);
+    }
+    Value add_to(Value other_val) {
+        if(kind == num_kind && other_val.kind == num_kind)
+            return num(rep + other_val.rep);
+        return other_add_to(other_val);
+    }
+    Value mult_with(Value other_val) {
+        if(kind == num_kind && other_val.kind == num_kind)
+            return num(rep * other_val.rep);
+        return other_mult_with(other_val);
+    }
+    bool is_ture() {
+        if(kind == bool_kind)
+            return rep;
+        return other_is_ture();
+    }
     PTR(Expr) to_expr();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
+    Value call(Value actual_arg);
+    void call_step(Value actual_arg_val, PTR(Cont) rest, Step &step);
     std::string to_string();
+    
+private:
+    bool other_equals(Value other_val);
+    Value other_add_to(Value other_val);
+    Value other_mult_with(Value other_val);
+    bool other_is_ture();
 };
 
-class BoolVal : public Val{
+/* A value that lives on the heap: a function. Numbers and
+ booleans are never boxed; their operations are `Value`'s. */
+class Val ENABLE_THIS(Val){
 public:
-    bool rep;
+    // Which subclass this is, so type checks need no RTTI
+    typedef enum {
+        func_val,
+        closure_val
+    } kind_t;
     
-    BoolVal(bool rep);
-    bool equals(PTR(Val) other_val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
-    bool is_ture();
-    PTR(Expr) to_expr();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
-    std::string to_string();
+    kind_t kind;
+    
+    virtual bool equals(Value other_val) = 0;
+    virtual Value add_to(Value other_val) = 0;
+    virtual Value mult_with(Value other_val) = 0;
+    virtual bool is_ture() = 0;
+    virtual PTR(Expr) to_expr() = 0;
+    virtual Value call(Value actual_arg) = 0;
+    virtual void call_step(Value actual_arg_val, PTR(Cont) rest, Step &step) = 0;
+    virtual std::string to_string() = 0;
+    // Mark the objects it points to (see gc.hpp)
+    virtual void trace(GC &gc) = 0;
 };
 
 class FuncVal : public Val{
 public:
-    std::string formal_arg;
+    Symbol formal_arg;
     PTR(Expr) body;
     PTR(Env) env;
+    Symbol self;  // bound to the function itself in each call, if named (see FuncExpr)
+    bool self_applied;
+    PTR(Expr) fun;  // the FuncExpr node with all of the above
     
-    FuncVal(std::string formal_arg, PTR(Expr) body, PTR(Env) env);
-    bool equals(PTR(Val) other_val);
-    PTR(Val) add_to(PTR(Val) other_val);
-    PTR(Val) mult_with(PTR(Val) other_val);
+    FuncVal(Symbol formal_arg, PTR(Expr) body, PTR(Env) env, Symbol self = Symbol(), bool self_applied = false);
+    // A closure of `fun`, a FuncExpr
+    FuncVal(PTR(Expr) fun, PTR(Env) env);
+    // Frame for a call with `actual_arg`: a CallEnv if the function is named
+    PTR(ExtendedEnv) frame(Value actual_arg);
+    bool equals(Value other_val);
+    Value add_to(Value other_val);
+    Value mult_with(Value other_val);
     bool is_ture();
     PTR(Expr) to_expr();
-    PTR(Val) call(PTR(Val) actual_arg);
-    void call_step(PTR(Val) actual_arg_val, PTR(Cont) rest);
+    Value call(Value actual_arg);
+    void call_step(Value actual_arg_val, PTR(Cont) rest, Step &step);
     std::string to_string();
+    void trace(GC &gc);
 };
 
 #endif /* value_hpp */
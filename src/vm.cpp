@@ -0,0 +1,548 @@
+//
+//  vm.cpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/12/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#include "vm.hpp"
+#include <algorithm>
+#include "arena.hpp"
+#include "expr.hpp"
+#include "env.hpp"
+#include "cont.hpp"
+#include "step.hpp"
+#include "gc.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+Scope::where_t Scope::resolve(Symbol name, int &index){
+    for(size_t i = names.size(); i-- > 0; ){
+        if(names[i] == name){
+            index = slots[i];
+            return local_var;
+        }
+    }
+    for(size_t i = 0; i < captured.size(); i++){
+        if(captured[i] == name){
+            index = (int)i;
+            return captured_var;
+        }
+    }
+    return free_var;
+}
+
+void Scope::trace(GC &gc){
+}
+
+int Code::emit(opcode_t op, int arg){
+    // How many of the last instructions may be fused with this one
+    int n = (int)instrs.size();
+    int fusable = n - label;
+    Instr *last = fusable >= 1 ? &instrs[n - 1] : nullptr;
+    Instr *before = fusable >= 2 ? &instrs[n - 2] : nullptr;
+    if(last != nullptr && last->op == OP_CONST && op == OP_ADD){
+        last->op = OP_ADD_CONST;
+        return n - 1;
+    }
+    if(last != nullptr && last->op == OP_EQU && op == OP_JUMP_IF_FALSE){
+        last->op = OP_JUMP_IF_NOT_EQU;
+        last->arg = arg;
+        return n - 1;
+    }
+    if(before != nullptr && op == OP_CALL && before->op == last->op && before->arg == last->arg
+       && (last->op == OP_LOAD || last->op == OP_LOAD_CAPTURED)){
+        before->op = last->op == OP_LOAD ? OP_CALL_SELF : OP_CALL_SELF_CAPTURED;
+        instrs.pop_back();
+        return n - 2;
+    }
+    Instr in = {op, arg};
+    instrs.push_back(in);
+    return n;
+}
+
+void Code::emit_load(Symbol name){
+    int index;
+    switch (scope->resolve(name, index)) {
+        case Scope::local_var:
+            emit(OP_LOAD, index);
+            break;
+        case Scope::captured_var:
+            emit(OP_LOAD_CAPTURED, index);
+            break;
+        case Scope::free_var:
+            emit(OP_FREE, add_name(name));
+            break;
+    }
+}
+
+void Code::patch(int at){
+    instrs[at].arg = (int)instrs.size();
+    label = (int)instrs.size();
+}
+
+int Code::add_const(Value val){
+    consts.push_back(val);
+    return (int)consts.size() - 1;
+}
+
+int Code::add_name(Symbol name){
+    for(size_t i = 0; i < names.size(); i++)
+        if(names[i] == name) return (int)i;
+    names.push_back(name);
+    return (int)names.size() - 1;
+}
+
+int Code::add_func(Symbol formal_arg, PTR(Expr) body, const std::vector<Symbol> &free_vars, Symbol self, bool self_applied){
+    Proto p = {formal_arg, body, std::vector<Symbol>(), -1, 0, self, self_applied};
+    int index;
+    for(size_t i = 0; i < free_vars.size(); i++)
+        if(scope->resolve(free_vars[i], index) != Scope::free_var)
+            p.captured.push_back(free_vars[i]);
+    funcs.push_back(p);
+    return (int)funcs.size() - 1;
+}
+
+int Code::bind(Symbol name){
+    scope->names.push_back(name);
+    scope->slots.push_back(nslots);
+    return nslots++;
+}
+
+void Code::unbind(){
+    scope->names.pop_back();
+    scope->slots.pop_back();
+}
+
+void Code::trace(GC &gc){
+    for(Value &val : consts)
+        gc.mark(val);
+    for(Proto &p : funcs)
+        gc.mark(RAW(p.body));
+    gc.mark(RAW(scope));
+}
+
+PTR(Code) Code::compile(PTR(Expr) e){
+    PTR(Code) code = NEW(Code)();
+    code->scope = NEW(Scope)();
+    code->nslots = 0;
+    code->label = 0;
+    e->compile(code);
+    code->emit(OP_HALT, 0);
+    code->top_slots = code->nslots;
+    // Function bodies go after the top-level code. Compiling a body
+    // can register more functions, so `funcs` grows while we walk it.
+    for(size_t i = 0; i < code->funcs.size(); i++){
+        code->funcs[i].entry = (int)code->instrs.size();
+        code->label = code->funcs[i].entry;
+        code->scope = NEW(Scope)();
+        code->scope->captured = code->funcs[i].captured;
+        code->nslots = 0;
+        if(code->funcs[i].self != Symbol()){
+            code->scope->names.push_back(code->funcs[i].self);
+            code->scope->slots.push_back(-1);
+        }
+        code->bind(code->funcs[i].formal_arg);
+        PTR(Expr) body = code->funcs[i].body;
+        body->compile(code);
+        code->emit(OP_RETURN, 0);
+        code->funcs[i].nslots = code->nslots;
+    }
+    code->scope = nullptr;
+    return code;
+}
+
+ClosureVal::ClosureVal(PTR(Code) code, int func, const Value *captured, size_t ncaptured){
+    this->kind = Val::closure_val;
+    this->code = code;
+    this->func = func;
+    this->captured.assign(captured, captured + ncaptured);
+}
+
+bool ClosureVal::equals(Value other_val){
+    if(other_val.kind != Value::obj_kind || other_val.obj->kind != Val::closure_val)
+        return false;
+    ClosureVal *cv = static_cast<ClosureVal*>(RAW(other_val.obj));
+    const Proto &p = code->funcs[func];
+    const Proto &q = cv->code->funcs[cv->func];
+    if(p.self != q.self || p.self_applied != q.self_applied)
+        return to_expr()->equals(cv->to_expr());
+    return p.formal_arg == q.formal_arg && p.body->equals(q.body);
+}
+
+Value ClosureVal::add_to(Value other_val){
+    throw std::runtime_error((std::string)"No adding functions");
+}
+
+Value ClosureVal::mult_with(Value other_val){
+    throw std::runtime_error((std::string)"No multiplying functions");
+}
+
+bool ClosureVal::is_ture(){
+    throw std::runtime_error((std::string)"evaluate non-boolean");
+}
+
+PTR(Expr) ClosureVal::to_expr(){
+    const Proto &p = code->funcs[func];
+    return CAST(FuncExpr)(FuncExpr::make(p.formal_arg, p.body, p.self, p.self_applied))->source();
+}
+
+Value ClosureVal::call(Value actual_arg){
+    return VM::run(code, Value::object(THIS), actual_arg);
+}
+
+void ClosureVal::call_step(Value actual_arg_val, PTR(Cont) rest, Step &step){
+    step.mode = Step::continue_mode;
+    step.val = call(actual_arg_val);
+    step.cont = rest;
+}
+
+std::string ClosureVal::to_string(){
+    if(code->funcs[func].self != Symbol())
+        return to_expr()->to_string();
+    return "_fun (" + code->funcs[func].formal_arg.to_string() + ") " + code->funcs[func].body->to_string();
+}
+
+void ClosureVal::trace(GC &gc){
+    gc.mark(RAW(code));
+    for(Value &val : captured)
+        gc.mark(val);
+}
+
+/* Return address and frame base of a caller,
+ saved by OP_CALL and restored by OP_RETURN. */
+struct CallFrame {
+    int return_pc;
+    size_t base;
+};
+
+static inline Value pop(std::vector<Value> &stack){
+    Value val = std::move(stack.back());
+    stack.pop_back();
+    return val;
+}
+
+// Registers a running VM's stack, which holds every frame, with the collector
+struct StackRoots {
+    std::vector<Value> &stack;
+    
+    StackRoots(std::vector<Value> &stack) : stack(stack) {
+        GC::heap().add_roots(&stack, [](void *p, GC &gc) {
+            for(Value &val : *static_cast<std::vector<Value>*>(p))
+                gc.mark(val);
+        });
+    }
+    ~StackRoots() { GC::heap().remove_roots(&stack); }
+};
+
+// The closure running in the frame at `base`, or null at the top level
+static inline ClosureVal *frame_closure(std::vector<Value> &stack, size_t base){
+    return static_cast<ClosureVal*>(RAW(stack[base - 1].obj));
+}
+
+#if ENABLE_VM_PROFILE
+unsigned long VM::pairs[OP_COUNT][OP_COUNT];
+
+void VM::print_profile(std::ostream &out, size_t top){
+    static const char *const names[] = {
+        "CONST", "LOAD", "LOAD_CAPTURED", "STORE", "FREE",
+        "ADD", "MULT", "EQU", "JUMP", "JUMP_IF_FALSE",
+        "FUNC", "CALL", "RETURN", "HALT",
+        "ADD_CONST", "JUMP_IF_NOT_EQU", "CALL_SELF", "CALL_SELF_CAPTURED"
+    };
+    std::vector<std::pair<unsigned long, std::pair<int, int> > > counts;
+    unsigned long total = 0;
+    for(int a = 0; a < OP_COUNT; a++){
+        // OP_HALT never runs before another opcode, so its row holds the starts of runs
+        if(a == OP_HALT) continue;
+        for(int b = 0; b < OP_COUNT; b++){
+            if(pairs[a][b] == 0) continue;
+            counts.push_back(std::make_pair(pairs[a][b], std::make_pair(a, b)));
+            total += pairs[a][b];
+        }
+    }
+    std::sort(counts.rbegin(), counts.rend());
+    for(size_t i = 0; i < counts.size() && i < top; i++)
+        out << names[counts[i].second.first] << " " << names[counts[i].second.second]
+            << "\t" << counts[i].first << "\t" << (100.0 * counts[i].first / total) << "%\n";
+}
+#endif
+
+Value VM::interp_by_vm(PTR(Expr) e){
+    // The code lives as long as the program; only running it uses the arena
+    PTR(Code) code = Code::compile(Expr::lower_recursion(e));
+    Arena arena;
+    return arena.escape(run(code, Value(), Value()));
+}
+
+Value VM::run(PTR(Code) code, Value closure, Value arg){
+    std::vector<Value> stack;
+    std::vector<CallFrame> frames;
+    const Instr *instrs = code->instrs.data();
+    int pc;
+    StackRoots roots(stack);
+    size_t region = GC::heap().start_region();
+    
+    // slot i of the current frame is stack[base + i]
+    size_t base = 1;
+    stack.push_back(closure);
+    ClosureVal *self = frame_closure(stack, base);
+    if(self == nullptr){
+        pc = 0;
+        stack.resize(base + code->top_slots);
+    }else{
+        const Proto &p = code->funcs[self->func];
+        pc = p.entry;
+        stack.push_back(arg);
+        stack.resize(base + p.nslots);
+    }
+
+    const Instr *in;
+#if ENABLE_VM_PROFILE
+    opcode_t last_op = OP_HALT;
+#define PROFILE() do { pairs[last_op][in->op]++; last_op = in->op; } while (0)
+#else
+#define PROFILE() do {} while (0)
+#endif
+#if ENABLE_THREADED_DISPATCH
+    // Handler address of each opcode, in opcode order
+    static const void *const labels[] = {
+        &&L_OP_CONST, &&L_OP_LOAD, &&L_OP_LOAD_CAPTURED, &&L_OP_STORE, &&L_OP_FREE,
+        &&L_OP_ADD, &&L_OP_MULT, &&L_OP_EQU, &&L_OP_JUMP, &&L_OP_JUMP_IF_FALSE,
+        &&L_OP_FUNC, &&L_OP_CALL, &&L_OP_RETURN, &&L_OP_HALT,
+        &&L_OP_ADD_CONST, &&L_OP_JUMP_IF_NOT_EQU, &&L_OP_CALL_SELF, &&L_OP_CALL_SELF_CAPTURED
+    };
+    if(code->threaded.size() != code->instrs.size()){
+        code->threaded.resize(code->instrs.size());
+        for(size_t i = 0; i < code->instrs.size(); i++)
+            code->threaded[i] = labels[code->instrs[i].op];
+    }
+    const void *const *targets = code->threaded.data();
+    // Each handler jumps straight to the next one
+#define CASE(op) L_##op
+#define NEXT() do { in = &instrs[pc]; PROFILE(); goto *targets[pc++]; } while (0)
+    NEXT();
+    {
+#else
+#define CASE(op) case op
+#define NEXT() continue
+    while (1) {
+        in = &instrs[pc++];
+        PROFILE();
+        switch (in->op) {
+#endif
+        CASE(OP_CONST):
+            stack.push_back(code->consts[in->arg]);
+            NEXT();
+        CASE(OP_LOAD): {
+            Value val = stack[base + in->arg];
+            stack.push_back(std::move(val));
+            NEXT();
+        }
+        CASE(OP_LOAD_CAPTURED):
+            stack.push_back(self->captured[in->arg]);
+            NEXT();
+        CASE(OP_STORE):
+            stack[base + in->arg] = pop(stack);
+            NEXT();
+        CASE(OP_FREE):
+            // throws the same error as the other interpreters
+            Env::emptyenv->lookup(code->names[in->arg]);
+            NEXT();
+        CASE(OP_ADD): {
+            Value rhs = pop(stack);
+            Value lhs = pop(stack);
+            stack.push_back(lhs.add_to(rhs));
+            NEXT();
+        }
+        CASE(OP_MULT): {
+            Value rhs = pop(stack);
+            Value lhs = pop(stack);
+            stack.push_back(lhs.mult_with(rhs));
+            NEXT();
+        }
+        CASE(OP_EQU): {
+            Value rhs = pop(stack);
+            Value lhs = pop(stack);
+            stack.push_back(Value::boolean(lhs.equals(rhs)));
+            NEXT();
+        }
+        CASE(OP_ADD_CONST): {
+            Value lhs = pop(stack);
+            stack.push_back(lhs.add_to(code->consts[in->arg]));
+            NEXT();
+        }
+        CASE(OP_JUMP):
+            pc = in->arg;
+            NEXT();
+        CASE(OP_JUMP_IF_FALSE):
+            if(!pop(stack).is_ture())
+                pc = in->arg;
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_EQU): {
+            Value rhs = pop(stack);
+            Value lhs = pop(stack);
+            if(!lhs.equals(rhs))
+                pc = in->arg;
+            NEXT();
+        }
+        CASE(OP_FUNC): {
+            size_t ncaptured = code->funcs[in->arg].captured.size();
+            Value fun = Value::object(NEW(ClosureVal)(code, in->arg, stack.data() + stack.size() - ncaptured, ncaptured));
+            stack.resize(stack.size() - ncaptured);
+            stack.push_back(std::move(fun));
+            NEXT();
+        }
+        CASE(OP_CALL_SELF): {
+            Value fun = stack[base + in->arg];
+            stack.push_back(fun);
+            stack.push_back(std::move(fun));
+            goto call;
+        }
+        CASE(OP_CALL_SELF_CAPTURED):
+            stack.push_back(self->captured[in->arg]);
+            stack.push_back(self->captured[in->arg]);
+            goto call;
+        CASE(OP_CALL):
+        call: {
+            const Value &callee = stack[stack.size() - 2];
+            ClosureVal *target = nullptr;
+            if(callee.kind == Value::obj_kind && callee.obj->kind == Val::closure_val)
+                target = static_cast<ClosureVal*>(RAW(callee.obj));
+            if(target == nullptr || target->code != code){
+                // Not compiled into this code: let the value make (or reject) the call
+                Value arg = pop(stack);
+                Value fun = pop(stack);
+                stack.push_back(fun.call(arg));
+                NEXT();
+            }
+            GC::heap().safepoint(region);
+            // The callee and argument stay where they are and
+            // become the new frame; the rest of its slots follow
+            CallFrame frame = {pc, base};
+            frames.push_back(frame);
+            base = stack.size() - 1;
+            self = target;
+            const Proto &p = code->funcs[target->func];
+            stack.resize(base + p.nslots);
+            pc = p.entry;
+            NEXT();
+        }
+        CASE(OP_RETURN): {
+            if(frames.empty())
+                return pop(stack);
+            Value result = pop(stack);
+            stack.resize(base - 1);
+            stack.push_back(std::move(result));
+            pc = frames.back().return_pc;
+            base = frames.back().base;
+            frames.pop_back();
+            self = frame_closure(stack, base);
+            NEXT();
+        }
+        CASE(OP_HALT):
+            return pop(stack);
+#if !ENABLE_THREADED_DISPATCH
+        case OP_COUNT:
+            // only the size of the profile table, never emitted
+            throw std::runtime_error((std::string)"bad opcode");
+        }
+#endif
+    }
+#undef CASE
+#undef NEXT
+#undef PROFILE
+}
+
+TEST_CASE("vm"){
+    CHECK( VM::interp_by_vm(parse_str("1 + 2 * 3")).equals(Value::num(7)) );
+    CHECK( VM::interp_by_vm(parse_str("_let x = 6 _in _let x = 19 _in x")).equals(Value::num(19)) );
+    CHECK( VM::interp_by_vm(parse_str("_let x = 5 _in (_let x = 1 _in x) + x")).equals(Value::num(6)) );
+    CHECK( VM::interp_by_vm(parse_str("_if 5 == 3 _then 2 _else 89")).equals(Value::num(89)) );
+    CHECK( VM::interp_by_vm(parse_str("3 == 3")).equals(Value::boolean(true)) );
+    CHECK( VM::interp_by_vm(parse_str("_let add = _fun (x) _fun (y) x + y _in _let addFive = add(5) _in addFive(10)"))
+          .equals(Value::num(15)) );
+    CHECK( VM::interp_by_vm(parse_str("_fun (x) x * x")).to_string() == "_fun (x) x * x" );
+    CHECK( VM::interp_by_vm(parse_str("_let factrl = _fun(factrl)"
+                                      "                _fun(x)"
+                                      "                  _if x == 1"
+                                      "                  _then 1"
+                                      "                  _else x * factrl(factrl)(x + -1)"
+                                      "_in factrl(factrl)(5)")).to_string() == "120" );
+    CHECK( VM::interp_by_vm(parse_str("_let fib = _fun (fib)"
+                                      "              _fun (x)"
+                                      "                 _if x == 0"
+                                      "                 _then 1"
+                                      "                 _else _if x == 2 + -1"
+                                      "                 _then 1"
+                                      "                 _else fib(fib)(x + -1)"
+                                      "                       + fib(fib)(x + -2)"
+                                      "_in fib(fib)(10)")).to_string() == "89" );
+    CHECK( VM::interp_by_vm(parse_str("_let countdown = _fun(countdown) _fun(n) _if n == 0 _then 0 _else countdown(countdown)(n + -1) _in countdown(countdown)(1000000)"))
+          .equals(Value::num(0)) );
+    CHECK( VM::interp_by_vm(parse_str("_let f = _fun (x) x + 1 _in f")).call(Value::num(2)).equals(Value::num(3)) );
+
+    CHECK_THROWS_WITH( VM::interp_by_vm(parse_str("1 + _true")), "Addend is not a number" );
+    CHECK_THROWS_WITH( VM::interp_by_vm(parse_str("1(2)")), "not call a num" );
+    CHECK_THROWS( VM::interp_by_vm(parse_str("x + 1")) );
+    CHECK( VM::interp_by_vm(parse_str("_if _true _then 1 _else x")).equals(Value::num(1)) );
+}
+
+TEST_CASE("lexical addressing"){
+    CHECK( VM::interp_by_vm(parse_str("_let a = 1 _in _let g = _fun (x) _fun (y) _fun (z) a + x + y + z _in g(2)(3)(4)"))
+          .equals(Value::num(10)) );
+    CHECK( VM::interp_by_vm(parse_str("_let f = _fun (x) (_let y = x + 1 _in _let x = y * 2 _in x + y) _in f(3)"))
+          .equals(Value::num(12)) );
+    
+    // `x` and `b` are slots 0 and 1 of the function's own frame; `a` is
+    // copied into the closure, and `unused` is not
+    PTR(Code) code = Code::compile(parse_str("_let a = 1 _in _let unused = 2 _in _fun (x) _let b = x _in a + b"));
+    CHECK( code->top_slots == 2 );
+    CHECK( code->funcs[0].nslots == 2 );
+    REQUIRE( code->funcs[0].captured.size() == 1 );
+    CHECK( code->funcs[0].captured[0] == "a" );
+    std::vector<Instr> loads;
+    for(size_t i = code->funcs[0].entry; i < code->instrs.size(); i++)
+        if(code->instrs[i].op == OP_LOAD || code->instrs[i].op == OP_LOAD_CAPTURED)
+            loads.push_back(code->instrs[i]);
+    REQUIRE( loads.size() == 3 );
+    CHECK( (loads[0].op == OP_LOAD && loads[0].arg == 0) );
+    CHECK( (loads[1].op == OP_LOAD_CAPTURED && loads[1].arg == 0) );
+    CHECK( (loads[2].op == OP_LOAD && loads[2].arg == 1) );
+    
+    // a capture of a capture: `a` goes from the top level through `g` into `h`
+    CHECK( VM::interp_by_vm(parse_str("_let a = 1 _in _let g = _fun (x) _fun (y) a + y _in g(0)(2)"))
+          .equals(Value::num(3)) );
+    CHECK_THROWS_WITH( VM::interp_by_vm(parse_str("_let f = _fun (x) y _in f(1)")), "free variabley" );
+}
+
+TEST_CASE("superinstructions"){
+    PTR(Code) code = Code::compile(parse_str("_let fib = _fun (fib)"
+                                             "              _fun (x)"
+                                             "                 _if x == 0"
+                                             "                 _then 1"
+                                             "                 _else _if x == 2 + -1"
+                                             "                 _then 1"
+                                             "                 _else fib(fib)(x + -1) + fib(fib)(x + -2)"
+                                             "_in fib(fib)(10)"));
+    std::set<opcode_t> ops;
+    for(size_t i = 0; i < code->instrs.size(); i++)
+        ops.insert(code->instrs[i].op);
+    CHECK( ops.count(OP_ADD_CONST) == 1 );
+    CHECK( ops.count(OP_JUMP_IF_NOT_EQU) == 1 );
+    CHECK( ops.count(OP_CALL_SELF) == 1 );
+    CHECK( ops.count(OP_CALL_SELF_CAPTURED) == 1 );
+    CHECK( ops.count(OP_EQU) == 0 );
+    CHECK( ops.count(OP_JUMP_IF_FALSE) == 0 );
+    CHECK( VM::run(code, Value(), Value()).equals(Value::num(89)) );
+    
+    // The last instruction of a branch is not fused with what follows the `_if`,
+    // where the other branch jumps to
+    CHECK( VM::interp_by_vm(parse_str("1 + (_if _true _then 2 _else 3)")).equals(Value::num(3)) );
+    CHECK( VM::interp_by_vm(parse_str("1 + (_if _false _then 2 _else 3)")).equals(Value::num(4)) );
+    CHECK( VM::interp_by_vm(parse_str("_if (_if _true _then _false _else 1 == 1) _then 5 _else 6")).equals(Value::num(6)) );
+    CHECK( VM::interp_by_vm(parse_str("_let f = _fun (f) _fun (x) x + 1 _in _let g = f(f) _in g(1) + g(2)")).equals(Value::num(5)) );
+    CHECK_THROWS_WITH( VM::interp_by_vm(parse_str("_let x = 1 _in x(x)")), "not call a num" );
+    CHECK_THROWS_WITH( VM::interp_by_vm(parse_str("_true + 1")), "No adding booleans" );
+}
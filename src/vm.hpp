@@ -0,0 +1,197 @@
+//
+//  vm.hpp
+//  Interpreter
+//
+//  Created by Xuefeng Xu on 4/12/20.
+//  Copyright © 2020 Xuefeng Xu. All rights reserved.
+//
+
+#ifndef vm_hpp
+#define vm_hpp
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "pointer.hpp"
+#include "value.hpp"
+#include "symbol.hpp"
+#include "arena.hpp"
+
+// 1: direct-threaded dispatch with computed goto (GCC and Clang), 0: a switch
+#ifndef ENABLE_THREADED_DISPATCH
+#if defined(__GNUC__)
+#define ENABLE_THREADED_DISPATCH 1
+#else
+#define ENABLE_THREADED_DISPATCH 0
+#endif
+#endif
+
+// 1: count how often each opcode runs right after each other one (see VM::print_profile)
+#ifndef ENABLE_VM_PROFILE
+#define ENABLE_VM_PROFILE 0
+#endif
+
+class Expr;
+class Cont;
+class Step;
+class GC;
+
+typedef enum {
+    OP_CONST,          // push consts[arg]
+    OP_LOAD,           // push slot arg of the current frame
+    OP_LOAD_CAPTURED,  // push captured value arg of the running closure
+    OP_STORE,          // pop a value into slot arg of the current frame
+    OP_FREE,           // fail: names[arg] is not bound
+    OP_ADD,            // pop rhs and lhs, push lhs + rhs
+    OP_MULT,           // pop rhs and lhs, push lhs * rhs
+    OP_EQU,            // pop rhs and lhs, push lhs == rhs
+    OP_JUMP,           // continue at arg
+    OP_JUMP_IF_FALSE,  // pop test, continue at arg if it is false
+    OP_FUNC,           // pop the values funcs[arg] captures, push a closure of them
+    OP_CALL,           // pop argument and callee, enter the callee's body
+    OP_RETURN,         // leave a function body, back to the caller
+    OP_HALT,           // end of the top-level expression
+    // Superinstructions, which `Code::emit` makes of the sequence in brackets
+    OP_ADD_CONST,      // pop lhs, push lhs + consts[arg]  [CONST arg, ADD]
+    OP_JUMP_IF_NOT_EQU, // pop rhs and lhs, continue at arg unless lhs == rhs  [EQU, JUMP_IF_FALSE arg]
+    OP_CALL_SELF,      // call slot arg with itself  [LOAD arg, LOAD arg, CALL]
+    OP_CALL_SELF_CAPTURED, // call captured value arg with itself  [LOAD_CAPTURED arg twice, CALL]
+    OP_COUNT           // number of opcodes
+} opcode_t;
+
+struct Instr {
+    opcode_t op;
+    int arg;
+};
+
+/* Compile-time view of the variables visible at one point
+ of a function body: its own, innermost last, with their
+ slots, and the ones its closure captured. Anything else
+ is free. */
+class Scope ENABLE_THIS(Scope) {
+public:
+    typedef enum {
+        local_var,
+        captured_var,
+        free_var
+    } where_t;
+    
+    std::vector<Symbol> names;
+    std::vector<int> slots;
+    std::vector<Symbol> captured;
+    
+    // Find where a variable lives and its slot or captured index
+    where_t resolve(Symbol name, int &index);
+    void trace(GC &gc);
+};
+
+/* A function body known to the compiler. `entry` is
+ the index of its first instruction in `Code::instrs`,
+ and `nslots` is the size of its frame: slot 0 is the
+ argument, the rest are the `_let`s in the body. A named
+ function's `self` is slot -1, where the callee sits.
+ `captured` are the free variables of the function that
+ are bound where it is created, in closure order. */
+struct Proto {
+    Symbol formal_arg;
+    PTR(Expr) body;
+    std::vector<Symbol> captured;
+    int entry;
+    int nslots;
+    Symbol self;
+    bool self_applied;
+};
+
+/* Flat instruction stream for one top-level expression
+ and every function body nested in it. */
+class Code ENABLE_THIS(Code) {
+public:
+    std::vector<Instr> instrs;
+    std::vector<Value> consts;
+    std::vector<Symbol> names;
+    std::vector<Proto> funcs;
+    int top_slots;  // frame size for the top-level expression
+    // Handler address of each instruction, filled in by the VM on first run
+    std::vector<const void*> threaded;
+    
+    // Compiler state: the scope being compiled and its frame size so far
+    PTR(Scope) scope;
+    int nslots;
+    // and the last jump target, which no superinstruction may span
+    int label;
+    
+    /* Append an instruction, fused with the ones before it
+     when they make a superinstruction. Returns the index
+     of the instruction that holds `arg`. */
+    int emit(opcode_t op, int arg);
+    // Emit whichever load reaches `name` from the current scope
+    void emit_load(Symbol name);
+    // Point the jump emitted at `at` to the next instruction
+    void patch(int at);
+    int add_const(Value val);
+    int add_name(Symbol name);
+    // Register a function body, capturing those of `free_vars` visible here
+    int add_func(Symbol formal_arg, PTR(Expr) body, const std::vector<Symbol> &free_vars, Symbol self, bool self_applied);
+    // Give a `_let` variable the next slot of the current frame
+    int bind(Symbol name);
+    // End the scope of the last variable bound
+    void unbind();
+    // Mark the constants and function bodies (see gc.hpp)
+    void trace(GC &gc);
+    
+    /* Compile an expression and all its function bodies.
+     The top-level code starts at 0 and ends with OP_HALT;
+     each function body ends with OP_RETURN. */
+    static PTR(Code) compile(PTR(Expr) e);
+};
+
+/* Closure created by the VM: a compiled function body
+ and a copy of the values it captured, indexed as in
+ `Proto::captured`. */
+class ClosureVal : public Val {
+public:
+    PTR(Code) code;
+    int func;
+    ArenaVector<Value> captured;
+    
+    ClosureVal(PTR(Code) code, int func, const Value *captured, size_t ncaptured);
+    bool equals(Value other_val);
+    Value add_to(Value other_val);
+    Value mult_with(Value other_val);
+    bool is_ture();
+    PTR(Expr) to_expr();
+    Value call(Value actual_arg);
+    void call_step(Value actual_arg_val, PTR(Cont) rest, Step &step);
+    std::string to_string();
+    void trace(GC &gc);
+};
+
+// `captured` lives in the same arena
+template <> struct arena_needs_finalizer<ClosureVal> {
+    static const bool value = false;
+};
+
+class VM {
+public:
+    /* Compile an expression to bytecode and run it.
+     Like `Step::interp_by_steps`, function calls use
+     the VM's own stacks instead of the C++ stack, and
+     running allocates in its own arena. The program is
+     compiled after `Expr::lower_recursion`. */
+    static Value interp_by_vm(PTR(Expr) e);
+    
+    /* Run `code` from the top until OP_HALT, or, when given
+     one of its closures, call it with `arg` until the
+     matching OP_RETURN. Frames live on the value stack:
+     a call's frame is the callee, then its slots. */
+    static Value run(PTR(Code) code, Value closure, Value arg);
+    
+#if ENABLE_VM_PROFILE
+    // pairs[a][b]: how many times opcode b ran right after opcode a
+    static unsigned long pairs[OP_COUNT][OP_COUNT];
+    // Print the `top` most frequent pairs run so far
+    static void print_profile(std::ostream &out, size_t top);
+#endif
+};
+
+#endif /* vm_hpp */